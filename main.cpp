@@ -1,272 +1,5382 @@
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <charconv>
+#include <chrono>
+#include <concepts>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <new>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <random>
 #include <string>
+#include <span>
 #include <sstream>
+#include <stdexcept>
 #include <string_view>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include <cassert>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <system_error>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
 
 using namespace std::literals;
 
+// Компактное хранилище имени домена размером 32 байта (как std::string), но с вдвое большей
+// встроенной ёмкостью: имена до kInlineCapacity байт (а это подавляющее большинство реальных
+// доменов) лежат прямо в объекте, более длинные - в отдельном буфере в куче.
+// Последний байт объекта - тег: длина встроенного имени либо kHeapTag
+class DomainName {
+public:
+    static constexpr size_t kInlineCapacity = 31;
+
+    DomainName(std::string_view name) {
+        if (name.size() <= kInlineCapacity) {
+            std::memcpy(storage_, name.data(), name.size());
+            storage_[kInlineCapacity] = static_cast<char>(name.size());
+        } else {
+            HeapName heap{new char[name.size()], name.size()};
+            std::memcpy(heap.data, name.data(), name.size());
+            std::memcpy(storage_, &heap, sizeof(heap));
+            storage_[kInlineCapacity] = static_cast<char>(kHeapTag);
+        }
+    }
+
+    DomainName(const DomainName& other) : DomainName(other.View()) {
+    }
+
+    DomainName(DomainName&& other) noexcept {
+        std::memcpy(storage_, other.storage_, sizeof(storage_));
+        other.storage_[kInlineCapacity] = 0;
+    }
+
+    DomainName& operator=(const DomainName& other) {
+        if (this != &other) {
+            *this = DomainName(other.View());
+        }
+        return *this;
+    }
+
+    DomainName& operator=(DomainName&& other) noexcept {
+        if (this != &other) {
+            Release();
+            std::memcpy(storage_, other.storage_, sizeof(storage_));
+            other.storage_[kInlineCapacity] = 0;
+        }
+        return *this;
+    }
+
+    ~DomainName() {
+        Release();
+    }
+
+    std::string_view View() const noexcept {
+        if (!IsOnHeap()) {
+            return {storage_, static_cast<unsigned char>(storage_[kInlineCapacity])};
+        }
+        const HeapName heap = GetHeapName();
+        return {heap.data, heap.size};
+    }
+
+    bool IsOnHeap() const noexcept {
+        return static_cast<unsigned char>(storage_[kInlineCapacity]) == kHeapTag;
+    }
+
+private:
+    static constexpr unsigned char kHeapTag = 0xFF;
+
+    struct HeapName {
+        char* data;
+        size_t size;
+    };
+
+    HeapName GetHeapName() const noexcept {
+        HeapName heap;
+        std::memcpy(&heap, storage_, sizeof(heap));
+        return heap;
+    }
+
+    void Release() noexcept {
+        if (IsOnHeap()) {
+            delete[] GetHeapName().data;
+        }
+    }
+
+    alignas(HeapName) char storage_[kInlineCapacity + 1] = {};
+};
+
+static_assert(sizeof(DomainName) == DomainName::kInlineCapacity + 1);
+
 class Domain {
 public:
     // для тестирование конструирования объекта Domain из string
     friend std::ostream& operator<<(std::ostream&, const Domain&);
 
-    Domain(std::string_view domain_name) : domain_name_{std::string(domain_name)} {
+    Domain(std::string_view domain_name) : domain_name_{domain_name} {
     }
 
     bool operator==(const Domain& other) const noexcept {
-        return domain_name_ == other.domain_name_;
+        return domain_name_.View() == other.domain_name_.View();
     }
 
     // сравнивает имена доменов лексикографически, начиная с конца строки, более короткие домены считаются меньше длинных (.ru < .cru) 
     bool operator<(const Domain& other) const noexcept {
-        return std::lexicographical_compare(domain_name_.rbegin(), domain_name_.rend(), 
-            other.domain_name_.rbegin(), other.domain_name_.rend(),
+        return Less(domain_name_.View(), other.domain_name_.View());
+    }
+
+    // проверяет, что домен совпадает с other или является его поддоменом, без выделения памяти
+    bool IsSubdomain(const Domain& other) const noexcept {
+        return IsSubdomainOf(domain_name_.View(), other.domain_name_.View());
+    }
+
+    // то же для голых имён, чтобы искать по упорядоченным доменам части имени, не создавая Domain
+    static bool Less(std::string_view name, std::string_view other_name) noexcept {
+        return std::lexicographical_compare(name.rbegin(), name.rend(), 
+            other_name.rbegin(), other_name.rend(),
             [](char l, char r) {
                 return (l == '.' || l < r) && (r != '.');
         });
     }
 
-    bool IsSubdomain(const Domain& other) const {
-        return domain_name_.size() >= other.domain_name_.size() &&
-               std::string_view('.' + domain_name_).ends_with("." + other.domain_name_);
+    static bool IsSubdomainOf(std::string_view name, std::string_view parent) noexcept {
+        return name.ends_with(parent) &&
+               (name.size() == parent.size() || name[name.size() - parent.size() - 1] == '.');
     }
-private:
-    std::string domain_name_;
-};
-
-class DomainChecker {
-public:
-    // для тестирование конструирования объекта DomainChecker из двух итераторов
-    friend std::ostream& operator<<(std::ostream&, const DomainChecker&);
 
-    template <typename InputIter>
-    DomainChecker(InputIter begin, InputIter end) : forbidden_domains_(begin, end) {
-        PrepareForbiddenDomains();
+    // 8-байтовый ключ из последних символов имени, взятых с конца. Порядок ключей согласован с operator<:
+    // из a < b следует a.SortKey() <= b.SortKey(), поэтому разные ключи решают сравнение без чтения имён
+    uint64_t SortKey() const noexcept {
+        const std::string_view name = domain_name_.View();
+        uint64_t key = 0;
+        for (size_t i = 0; i < sizeof(key); ++i) {
+            key = key << CHAR_BIT | (i < name.size() ? CharRank(name[name.size() - 1 - i]) : 0);
+        }
+        return key;
     }
 
-    bool IsForbidden(const Domain& domain) const {
-        auto find_domain = std::upper_bound(forbidden_domains_.begin(), forbidden_domains_.end(), domain);
+    std::string_view Name() const noexcept {
+        return domain_name_.View();
+    }
 
-        return find_domain == forbidden_domains_.begin()
-                                                         ? false
-                                                         : domain.IsSubdomain(*(--find_domain));
+    // метка верхнего уровня: всё после последней точки ("ru" для "gdz.ru")
+    std::string_view TopLevelLabel() const noexcept {
+        const std::string_view name = domain_name_.View();
+        const size_t dot = name.rfind('.');
+        return dot == std::string_view::npos ? name : name.substr(dot + 1);
     }
 private:
-    // сортирует вектор доменов, убирает дубликаты и лишние поддомены
-    void PrepareForbiddenDomains() const {
-        std::sort(forbidden_domains_.begin(), forbidden_domains_.end());
-
-        auto new_end_iter = std::unique(forbidden_domains_.begin(), forbidden_domains_.end(), 
-            [](const Domain& lhs, const Domain& rhs) {
-                return lhs.IsSubdomain(rhs) || rhs.IsSubdomain(lhs);
-        });
-        forbidden_domains_.erase(new_end_iter, forbidden_domains_.end());
+    // ранг символа в порядке operator<: 0 - конец имени, 1 - точка, остальные символы по возрастанию.
+    // Два самых маленьких символа делят ранг 2, равенство ключей всё равно проверяется полным сравнением
+    static uint64_t CharRank(char c) noexcept {
+        if (c == '.') {
+            return 1;
+        }
+        return std::max(2, static_cast<int>(c) - CHAR_MIN);
     }
 
-    mutable std::vector<Domain> forbidden_domains_;
+    DomainName domain_name_;
 };
 
-// Читаем number доменов из потока input
-std::vector<Domain> ReadDomains(std::istream& input, const size_t number) {
-    std::vector<Domain> domains;
-    domains.reserve(number);
-    if(!number) {
-        return domains;
+// подсказывает процессору заранее загрузить в кэш строку по адресу address
+inline void Prefetch(const void* address) noexcept {
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(address);
+#endif
+}
+
+// Дописывает value в out как LEB128: по 7 бит, начиная с младших, старший бит байта - признак продолжения
+inline void AppendVarint(std::string& out, uint64_t value) {
+    for (; value >= 0x80; value >>= 7) {
+        out += static_cast<char>((value & 0x7F) | 0x80);
     }
-    for(size_t i = 0; i < number; ++i) {
-        std::string domain_name;
-        getline(input, domain_name);
-        domains.emplace_back(std::move(domain_name));
+    out += static_cast<char>(value);
+}
+
+// Читает LEB128 из начала data и отрезает его; std::nullopt, если число оборвано или длиннее 64 бит
+inline std::optional<uint64_t> ReadVarint(std::string_view& data) noexcept {
+    uint64_t value = 0;
+    for (size_t i = 0; i < data.size() && i < 10; ++i) {
+        const unsigned char byte = static_cast<unsigned char>(data[i]);
+        value |= static_cast<uint64_t>(byte & 0x7F) << (7 * i);
+        if (byte < 0x80) {
+            data.remove_prefix(i + 1);
+            return value;
+        }
     }
-    return domains;
+    return std::nullopt;
 }
 
-template <typename Number>
-Number ReadNumberOnLine(std::istream& input) {
-    std::string line;
-    getline(input, line);
+// Размещение больших массивов индекса на страницах по 2 МБ: при случайных обращениях бинарного поиска
+// почти каждое обращение к обычным 4-килобайтным страницам промахивается мимо TLB.
+// Сначала пробуются явные huge pages (MAP_HUGETLB), если их не выделено в системе - прозрачные
+// (madvise(MADV_HUGEPAGE)), а если не вышло и это - остаются обычные страницы
+class HugePages {
+public:
+    static constexpr size_t kPageSize = 2 * 1024 * 1024;
 
-    Number num;
-    std::istringstream(line) >> num;
+    static void SetEnabled(bool enabled) noexcept {
+        enabled_ = enabled;
+    }
 
-    return num;
-}
+    static bool IsEnabled() noexcept {
+        return enabled_;
+    }
 
-// ********************************** Тесты *******************************************************
-std::ostream& operator<<(std::ostream& out, const Domain& domain) {
-    out << domain.domain_name_;
-    return out;
-}
+    // массивы меньше страницы выделяются обычным operator new
+    static bool IsLarge(size_t bytes) noexcept {
+        return bytes >= kPageSize;
+    }
 
-std::ostream& operator<<(std::ostream& out, const std::vector<Domain>& domains) {
-    for(const Domain& domain : domains) {
-        out << domain << std::endl;
+    static void* Allocate(size_t bytes) {
+#ifdef __linux__
+        bytes = RoundUp(bytes);
+        if (enabled_) {
+            void* memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (memory != MAP_FAILED) {
+                explicit_bytes_ += bytes;
+                return memory;
+            }
+        }
+        void* memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        if (enabled_ && madvise(memory, bytes, MADV_HUGEPAGE) == 0) {
+            transparent_bytes_ += bytes;
+        }
+        return memory;
+#else
+        return ::operator new(bytes);
+#endif
     }
-    return out;
-}
 
-std::ostream& operator<<(std::ostream& out, const DomainChecker& checker) {
-    out << checker.forbidden_domains_;
-    return out;
-}
+    static void Deallocate(void* memory, size_t bytes) noexcept {
+#ifdef __linux__
+        munmap(memory, RoundUp(bytes));
+#else
+        ::operator delete(memory);
+#endif
+    }
 
-void TestDomain() {
-    // тестирование конструктора и оператора ==
-    {
-        std::string s1("com"sv);
-        std::string s2("ru"sv);
-        std::ostringstream ostr_stream;
-        
-        Domain domain1(s1);
-        ostr_stream << domain1;
-        assert(ostr_stream.str() == s1);
-        ostr_stream.str("");
-        ostr_stream.clear();
+    // сколько байт было размещено на явных и на прозрачных huge pages
+    static size_t ExplicitBytes() noexcept {
+        return explicit_bytes_;
+    }
 
-        Domain domain2(s2);
-        ostr_stream << domain2;
-        assert(ostr_stream.str() == s2);
-        assert(domain1 != domain2);
+    static size_t TransparentBytes() noexcept {
+        return transparent_bytes_;
     }
-    {
-        std::string s1("com"sv);
-        std::string s2("com"sv);
-        Domain domain1(s1);
-        Domain domain2(s2);
-        assert(domain1 == domain2);
+private:
+    static size_t RoundUp(size_t bytes) noexcept {
+        return (bytes + kPageSize - 1) / kPageSize * kPageSize;
     }
-    // тестирование IsSubdomain
-    {
-        Domain domain("com"sv);
-        Domain subdomain("duck.com"sv);
-        assert(subdomain.IsSubdomain(domain) == true);
-        Domain not_subdomain("duck.ru"sv);
-        assert(not_subdomain.IsSubdomain(domain) == false);
+
+    static inline std::atomic<bool> enabled_ = false;
+    static inline std::atomic<size_t> explicit_bytes_ = 0;
+    static inline std::atomic<size_t> transparent_bytes_ = 0;
+};
+
+// Аллокатор для основных массивов индекса: большие массивы размещаются через HugePages
+template <typename T>
+struct HugePageAllocator {
+    using value_type = T;
+
+    HugePageAllocator() noexcept = default;
+
+    template <typename U>
+    HugePageAllocator(const HugePageAllocator<U>&) noexcept {
     }
-    {
-        Domain domain("com"sv);
-        Domain subdomain("alter.duck.com"sv);
-        assert(subdomain.IsSubdomain(domain));
+
+    T* allocate(size_t count) {
+        const size_t bytes = count * sizeof(T);
+        if (!HugePages::IsLarge(bytes)) {
+            return static_cast<T*>(::operator new(bytes));
+        }
+        return static_cast<T*>(HugePages::Allocate(bytes));
     }
-    {
-        Domain domain("class.com"sv);
-        Domain subdomain("class.com"sv);
-        assert(subdomain.IsSubdomain(domain) == true);
-        Domain not_subdomain("class.ru"sv);
-        assert(not_subdomain.IsSubdomain(domain) == false);
+
+    void deallocate(T* pointer, size_t count) noexcept {
+        const size_t bytes = count * sizeof(T);
+        if (!HugePages::IsLarge(bytes)) {
+            ::operator delete(pointer);
+        } else {
+            HugePages::Deallocate(pointer, bytes);
+        }
     }
-    {
-        Domain domain("class.com"sv);
-        Domain subdomain("duck.class.com"sv);
-        assert(subdomain.IsSubdomain(domain));
-        Domain not_subdomain("duck.com"sv);
-        assert(not_subdomain.IsSubdomain(domain) == false);
+
+    template <typename U>
+    bool operator==(const HugePageAllocator<U>&) const noexcept {
+        return true;
     }
-}
+};
 
-void TestReadDomains() {
-    std::ostringstream str_out;
-    // тестирование чтения не из пустого потока
-    {
-        const std::vector<Domain> domains = {"gdz.ru"sv,
-                                             "gdz.com"sv,
-                                             "m.maps.me"sv,
-                                             "alg.m.gdz.ru"sv,
-                                             "maps.com"sv,
-                                             "maps.ru"sv,
-                                             "gdz.ua"sv
-        };
-        str_out << domains;
+// HDR-подобная гистограмма задержек в наносекундах: значения группируются по степеням двойки, а каждая
+// степень делится на kSubBuckets равных частей, что даёт относительную погрешность не больше 1/kSubBuckets
+// при постоянном размере и записи без блокировок
+class LatencyHistogram {
+public:
+    static constexpr size_t kSubBucketBits = 4;
+    static constexpr size_t kSubBuckets = size_t{1} << kSubBucketBits;
 
-        std::istringstream in_str(str_out.str());
-    
-        const std::vector<Domain> test_domains = ReadDomains(in_str, domains.size());
-        assert(test_domains == domains);
+    void Record(uint64_t nanoseconds) noexcept {
+        buckets_[BucketIndex(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
     }
-    // тестирование чтения из пустого потока
-    {
-        std::istringstream in_str;
-        const std::vector<Domain> test_domains = ReadDomains(in_str, 0);
-        assert(test_domains == std::vector<Domain>{});
+
+    uint64_t Count() const noexcept {
+        uint64_t count = 0;
+        for (const auto& bucket : buckets_) {
+            count += bucket.load(std::memory_order_relaxed);
+        }
+        return count;
     }
-}
 
-void TestDomainChecker() {
-    std::ostringstream out_str;
-    const std::vector<Domain> domains = {"gdz.ua"sv,
-                                         "gdz.ub"sv,
-                                         "gdz.uc"sv,
-                                         "gdz.ud"sv,
-                                         "gdz.uf"sv,
-                                         "gdz.ug"sv
-    };
-    DomainChecker checker(domains.begin(), domains.end());
-    out_str << checker;
+    // нижняя граница корзины, в которую попало значение с долей ранга fraction (0.5 - медиана)
+    uint64_t Percentile(double fraction) const noexcept {
+        const uint64_t count = Count();
+        if (count == 0) {
+            return 0;
+        }
+        const uint64_t rank = std::min(count - 1, static_cast<uint64_t>(fraction * count));
+        uint64_t seen = 0;
+        for (size_t index = 0; index < buckets_.size(); ++index) {
+            seen += buckets_[index].load(std::memory_order_relaxed);
+            if (seen > rank) {
+                return BucketLowerBound(index);
+            }
+        }
+        return BucketLowerBound(buckets_.size() - 1);
+    }
 
-    std::ostringstream out_str2;
-    out_str2 << domains;
+    static size_t BucketIndex(uint64_t value) noexcept {
+        if (value < kSubBuckets) {
+            return static_cast<size_t>(value);
+        }
+        const size_t exponent = std::bit_width(value) - 1;
+        const size_t sub_bucket = (value >> (exponent - kSubBucketBits)) & (kSubBuckets - 1);
+        return (exponent - kSubBucketBits + 1) * kSubBuckets + sub_bucket;
+    }
 
-    std::string s1 = out_str.str();
-    std::string s2 = out_str2.str();
+    static uint64_t BucketLowerBound(size_t index) noexcept {
+        if (index < kSubBuckets) {
+            return index;
+        }
+        const size_t exponent = index / kSubBuckets + kSubBucketBits - 1;
+        return (kSubBuckets + index % kSubBuckets) << (exponent - kSubBucketBits);
+    }
+private:
+    std::array<std::atomic<uint64_t>, (64 - kSubBucketBits + 1) * kSubBuckets> buckets_{};
+};
 
-    assert(out_str.str() == out_str2.str());
-}
+#ifdef DOMAIN_FILTER_STATS
+// Собранная за время работы статистика: длительности фаз построения и обработки и выборочные задержки поиска
+class Stats {
+public:
+    static Stats& Instance() {
+        static Stats stats;
+        return stats;
+    }
 
-void TestIsForbidden() {
-    const std::vector<Domain> test_domains = {"gdz.ru"sv,
-                                              "gdz.com"sv,
-                                              "m.maps.me"sv,
-                                              "alg.m.gdz.ru"sv,
-                                              "maps.com"sv,
-                                              "maps.ru"sv,
-                                              "gdz.ua"sv
-    };
-    // тестирование при непустом списке запрещённых доменов
-    {
-        std::ostringstream out_str;
-        const std::vector<Domain> forbidden_domains = {"gdz.ru"sv,
-                                                       "maps.me"sv,
-                                                       "m.gdz.ru"sv,
-                                                       "com"sv
-        };
-        DomainChecker checker(forbidden_domains.begin(), forbidden_domains.end());
+    // задержки отдельных вызовов IsForbidden
+    LatencyHistogram& Lookups() noexcept {
+        return lookups_;
+    }
 
-        for (const Domain& domain : test_domains) {
-            out_str << (checker.IsForbidden(domain) ? "Bad"sv : "Good"sv) << std::endl;
+    // задержки IsForbiddenBatch в пересчёте на один запрос
+    LatencyHistogram& BatchLookups() noexcept {
+        return batch_lookups_;
+    }
+
+    void AddPhase(std::string_view name, std::chrono::nanoseconds duration) {
+        std::lock_guard lock(mutex_);
+        auto phase = phases_.find(name);
+        if (phase == phases_.end()) {
+            phase = phases_.emplace(std::string(name), Phase{}).first;
         }
-        assert(out_str.str() == "Bad\nBad\nBad\nBad\nBad\nGood\nGood\n"sv);
+        phase->second.total_ns += static_cast<uint64_t>(duration.count());
+        ++phase->second.count;
     }
-    // тестирование при пустом списке запрещённых доменов
-    {
-        std::ostringstream out_str;
-        const std::vector<Domain> forbidden_domains = {};
-        DomainChecker checker(forbidden_domains.begin(), forbidden_domains.end());
 
-        for (const Domain& domain : test_domains) {
-            out_str << (checker.IsForbidden(domain) ? "Bad"sv : "Good"sv) << std::endl;
+    // пишет статистику одним JSON-объектом
+    void Write(std::ostream& out) const {
+        std::lock_guard lock(mutex_);
+        out << "{\"phases\": {"sv;
+        bool first = true;
+        for (const auto& [name, phase] : phases_) {
+            out << (first ? ""sv : ", "sv) << '"' << name << "\": {\"count\": "sv << phase.count
+                << ", \"total_ns\": "sv << phase.total_ns << '}';
+            first = false;
         }
-        assert(out_str.str() == "Good\nGood\nGood\nGood\nGood\nGood\nGood\n"sv);
+        out << "}, \"lookup_ns\": "sv;
+        WriteHistogram(lookups_, out);
+        out << ", \"batch_lookup_ns\": "sv;
+        WriteHistogram(batch_lookups_, out);
+        out << '}' << std::endl;
     }
-}
+private:
+    struct Phase {
+        uint64_t total_ns = 0;
+        uint64_t count = 0;
+    };
 
-void Tests() {
-    TestDomain();
-    TestReadDomains();
-    TestDomainChecker();
-    TestIsForbidden();
-}
+    static void WriteHistogram(const LatencyHistogram& histogram, std::ostream& out) {
+        out << "{\"samples\": "sv << histogram.Count() << ", \"p50\": "sv << histogram.Percentile(0.5)
+            << ", \"p90\": "sv << histogram.Percentile(0.9) << ", \"p99\": "sv << histogram.Percentile(0.99)
+            << ", \"p999\": "sv << histogram.Percentile(0.999) << ", \"max\": "sv << histogram.Percentile(1.0) << '}';
+    }
 
-int main() {
-    const std::vector<Domain> forbidden_domains = ReadDomains(std::cin, ReadNumberOnLine<size_t>(std::cin));
-    DomainChecker checker(forbidden_domains.begin(), forbidden_domains.end());
+    mutable std::mutex mutex_;
+    std::map<std::string, Phase, std::less<>> phases_;
+    LatencyHistogram lookups_;
+    LatencyHistogram batch_lookups_;
+};
 
-    const std::vector<Domain> test_domains = ReadDomains(std::cin, ReadNumberOnLine<size_t>(std::cin));
-    for (const Domain& domain : test_domains) {
-        std::cout << (checker.IsForbidden(domain) ? "Bad"sv : "Good"sv) << std::endl;
+// Добавляет в статистику время жизни объекта как длительность фазы name
+class PhaseTimer {
+public:
+    explicit PhaseTimer(std::string_view name) : name_(name), start_(std::chrono::steady_clock::now()) {
+    }
+
+    ~PhaseTimer() {
+        Stats::Instance().AddPhase(name_, std::chrono::steady_clock::now() - start_);
+    }
+private:
+    std::string_view name_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+// Замеряет каждый sample_rate-й вызов в потоке и записывает в histogram время на один из queries_count запросов
+class SampledTimer {
+public:
+    static constexpr uint32_t kSampleRate = 1024;
+
+    SampledTimer(LatencyHistogram& histogram, size_t queries_count, uint32_t sample_rate = kSampleRate)
+        : histogram_(histogram), queries_count_(queries_count) {
+        thread_local uint32_t calls = 0;
+        sampled_ = ++calls % sample_rate == 0;
+        if (sampled_) {
+            start_ = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~SampledTimer() {
+        if (sampled_ && queries_count_ != 0) {
+            const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_);
+            histogram_.Record(static_cast<uint64_t>(elapsed.count()) / queries_count_);
+        }
+    }
+private:
+    LatencyHistogram& histogram_;
+    size_t queries_count_;
+    bool sampled_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+#define DOMAIN_FILTER_PHASE(name) const PhaseTimer domain_filter_phase_timer(name)
+#define DOMAIN_FILTER_SAMPLE(histogram, queries_count) \
+    const SampledTimer domain_filter_sampled_timer(Stats::Instance().histogram(), queries_count)
+// замер каждого вызова: для редких вызовов, каждый из которых проверяет много запросов
+#define DOMAIN_FILTER_RECORD(histogram, queries_count) \
+    const SampledTimer domain_filter_recorded_timer(Stats::Instance().histogram(), queries_count, 1)
+#else
+// без DOMAIN_FILTER_STATS замеры не компилируются
+#define DOMAIN_FILTER_PHASE(name)
+#define DOMAIN_FILTER_SAMPLE(histogram, queries_count)
+#define DOMAIN_FILTER_RECORD(histogram, queries_count)
+#endif
+
+// Пул потоков с перехватом работы. У каждого потока своя очередь: поток берёт задачи с конца своей
+// очереди, а когда она пуста - забирает с начала чужой, так что при неравных задачах простаивающих
+// потоков нет. Задачи, отправленные изнутри задачи, попадают в очередь текущего потока.
+// Поток, вызвавший Wait, сам выполняет задачи вместе с рабочими потоками; из задач Wait не вызывается
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(size_t threads_count = std::max(1u, std::thread::hardware_concurrency()))
+        : queues_(std::max<size_t>(1, threads_count)) {
+        for (size_t index = 1; index < queues_.size(); ++index) {
+            threads_.emplace_back([this, index] {
+                WorkerLoop(index);
+            });
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    ~WorkStealingPool() {
+        {
+            std::lock_guard lock(sleep_mutex_);
+            stop_ = true;
+        }
+        wake_up_.notify_all();
+        for (std::thread& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    size_t ThreadCount() const noexcept {
+        return queues_.size();
+    }
+
+    void Submit(std::function<void()> task) {
+        ++pending_;
+        {
+            Queue& queue = queues_[current_pool_ == this ? current_index_ : 0];
+            std::lock_guard lock(queue.mutex);
+            queue.tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard lock(sleep_mutex_);
+            ++queued_;
+        }
+        wake_up_.notify_one();
+    }
+
+    // выполняет задачи, пока не будут завершены все отправленные, и пробрасывает первое исключение из них
+    void Wait() {
+        while (pending_ > 0) {
+            if (!RunOne(current_pool_ == this ? current_index_ : 0)) {
+                std::this_thread::yield();
+            }
+        }
+        if (std::exception_ptr error = std::exchange(error_, nullptr)) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    // вызывает body для отрезков [begin, end) не длиннее grain, деля отрезок пополам в задачах,
+    // которые свободные потоки перехватывают, и ждёт завершения
+    template <typename Body>
+    void ParallelFor(size_t begin, size_t end, size_t grain, const Body& body) {
+        grain = std::max<size_t>(1, grain);
+        Submit([this, begin, end, grain, &body] {
+            Split(begin, end, grain, body);
+        });
+        Wait();
+    }
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    template <typename Body>
+    void Split(size_t begin, size_t end, size_t grain, const Body& body) {
+        while (end - begin > grain) {
+            const size_t middle = begin + (end - begin) / 2;
+            Submit([this, middle, end, grain, &body] {
+                Split(middle, end, grain, body);
+            });
+            end = middle;
+        }
+        body(begin, end);
+    }
+
+    // выполняет одну задачу из своей очереди или перехваченную из чужой; false, если задач нет
+    bool RunOne(size_t index) {
+        std::function<void()> task;
+        for (size_t i = 0; i < queues_.size() && !task; ++i) {
+            Queue& queue = queues_[(index + i) % queues_.size()];
+            std::lock_guard lock(queue.mutex);
+            if (queue.tasks.empty()) {
+                continue;
+            }
+            if (i == 0) {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            } else {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+        }
+        if (!task) {
+            return false;
+        }
+        {
+            std::lock_guard lock(sleep_mutex_);
+            --queued_;
+        }
+
+        WorkStealingPool* const outer_pool = std::exchange(current_pool_, this);
+        const size_t outer_index = std::exchange(current_index_, index);
+        try {
+            task();
+        } catch (...) {
+            std::lock_guard lock(sleep_mutex_);
+            if (!error_) {
+                error_ = std::current_exception();
+            }
+        }
+        current_pool_ = outer_pool;
+        current_index_ = outer_index;
+        --pending_;
+        return true;
+    }
+
+    void WorkerLoop(size_t index) {
+        for (;;) {
+            if (RunOne(index)) {
+                continue;
+            }
+            std::unique_lock lock(sleep_mutex_);
+            wake_up_.wait(lock, [this] {
+                return stop_ || queued_ > 0;
+            });
+            if (stop_) {
+                return;
+            }
+        }
+    }
+
+    static inline thread_local WorkStealingPool* current_pool_ = nullptr;
+    static inline thread_local size_t current_index_ = 0;
+
+    std::vector<Queue> queues_;
+    std::vector<std::thread> threads_;
+    std::atomic<size_t> pending_ = 0;
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_up_;
+    size_t queued_ = 0;
+    bool stop_ = false;
+    std::exception_ptr error_;
+};
+
+// Что запрещает правило: сам домен и все его поддомены или только сам домен
+enum class MatchMode : uint8_t {
+    kSubtree,
+    kExact,
+};
+
+struct ForbiddenRule {
+    Domain domain;
+    MatchMode mode = MatchMode::kSubtree;
+};
+
+// Политика учёта срабатываний правил по умолчанию: ничего не считает и полностью исчезает при компиляции
+struct NoHitCounter {
+    void Hit(size_t) noexcept {
+    }
+};
+
+class DomainChecker {
+public:
+    // число запросов, бинарные поиски которых IsForbiddenBatch ведёт одновременно
+    static constexpr size_t kBatchSize = 16;
+    // результат FindRule, если запрос не запрещён
+    static constexpr size_t kNoRule = SIZE_MAX;
+
+    // для тестирование конструирования объекта DomainChecker из двух итераторов
+    friend std::ostream& operator<<(std::ostream&, const DomainChecker&);
+
+    template <typename InputIter>
+        requires (!std::same_as<std::iter_value_t<InputIter>, ForbiddenRule>)
+    DomainChecker(InputIter begin, InputIter end) : forbidden_domains_(begin, end) {
+        PrepareForbiddenDomains();
+    }
+
+    // правила со своим режимом сопоставления; правила kSubtree поглощают всё, что под ними,
+    // а правила kExact не поглощают ничего
+    template <typename InputIter>
+        requires std::same_as<std::iter_value_t<InputIter>, ForbiddenRule>
+    DomainChecker(InputIter begin, InputIter end) {
+        PrepareForbiddenRules(std::vector<ForbiddenRule>(begin, end));
+    }
+
+    // Правила, уже упорядоченные и без покрытых доменов (например, из сжатого списка): сортировка
+    // не нужна, порядок лишь проверяется одним проходом
+    struct SortedRules {};
+
+    template <typename InputIter>
+    DomainChecker(SortedRules, InputIter begin, InputIter end) : forbidden_domains_(begin, end) {
+        {
+            DOMAIN_FILTER_PHASE("verify"sv);
+            const auto misplaced = std::adjacent_find(forbidden_domains_.begin(), forbidden_domains_.end(),
+                                                      [](const Domain& lhs, const Domain& rhs) {
+                return !(lhs < rhs) || rhs.IsSubdomain(lhs);
+            });
+            if (misplaced != forbidden_domains_.end()) {
+                throw std::invalid_argument("rules are not sorted: "s + std::string(misplaced->Name()));
+            }
+        }
+        BuildKeys();
+    }
+
+    // строит индекс, сортируя части массива и сливая их попарно в задачах пула
+    DomainChecker(std::vector<Domain> domains, WorkStealingPool& pool)
+        : forbidden_domains_(std::make_move_iterator(domains.begin()), std::make_move_iterator(domains.end())) {
+        ParallelSortForbiddenDomains(pool);
+        RemoveCoveredDomains();
+    }
+
+    bool IsForbidden(const Domain& domain) const {
+        return FindRule(domain) != kNoRule;
+    }
+
+    // проверяет domain и сообщает hit_counter номер сработавшего правила
+    template <typename HitCounter>
+    bool IsForbidden(const Domain& domain, HitCounter& hit_counter) const {
+        const size_t rule = FindRule(domain);
+        if (rule == kNoRule) {
+            return false;
+        }
+        hit_counter.Hit(rule);
+        return true;
+    }
+
+    // номер правила, запрещающего domain, или kNoRule
+    size_t FindRule(const Domain& domain) const {
+        DOMAIN_FILTER_SAMPLE(Lookups, 1);
+        const uint64_t key = domain.SortKey();
+        size_t upper_bound = 0;
+        for (size_t length = forbidden_domains_.size(); length > 0;) {
+            const size_t half = length / 2;
+            if (IsLess(domain, key, upper_bound + half)) {
+                length = half;
+            } else {
+                upper_bound += half + 1;
+                length -= half + 1;
+            }
+        }
+
+        return upper_bound != 0 && Covers(upper_bound - 1, domain) ? upper_bound - 1 : kNoRule;
+    }
+
+    size_t RuleCount() const noexcept {
+        return forbidden_domains_.size();
+    }
+
+    const Domain& Rule(size_t index) const {
+        return forbidden_domains_.at(index);
+    }
+
+    // правило index запрещает только сам домен (MatchMode::kExact)
+    bool IsExactRule(size_t index) const noexcept {
+        return !exact_rules_.empty() && exact_rules_[index];
+    }
+
+    // байты, занятые индексом: массивы правил и ключей и имена, не поместившиеся в Domain
+    size_t MemoryUsage() const noexcept {
+        size_t bytes = forbidden_domains_.capacity() * sizeof(Domain) + keys_.capacity() * sizeof(uint64_t) +
+                       exact_rules_.capacity() / CHAR_BIT;
+        for (const Domain& domain : forbidden_domains_) {
+            if (domain.Name().size() > DomainName::kInlineCapacity) {
+                bytes += domain.Name().size();
+            }
+        }
+        return bytes;
+    }
+
+    // проверяет domains и записывает результаты в verdicts. Бинарные поиски kBatchSize запросов
+    // идут в ногу: на каждом шаге все они сравниваются со своими элементами и сразу запрашивают
+    // загрузку следующих, так что промахи кэша разных запросов перекрываются, а не идут цепочкой
+    void IsForbiddenBatch(std::span<const Domain> domains, std::span<bool> verdicts) const {
+        assert(domains.size() == verdicts.size());
+        if (forbidden_domains_.empty()) {
+            std::fill(verdicts.begin(), verdicts.end(), false);
+            return;
+        }
+
+        for (size_t first = 0; first < domains.size(); first += kBatchSize) {
+            const size_t count = std::min(kBatchSize, domains.size() - first);
+            DOMAIN_FILTER_SAMPLE(BatchLookups, count);
+            const Domain* queries = domains.data() + first;
+            std::array<uint64_t, kBatchSize> keys;
+            std::array<size_t, kBatchSize> bases{};
+            for (size_t i = 0; i < count; ++i) {
+                keys[i] = queries[i].SortKey();
+            }
+
+            // длина отрезка поиска зависит только от размера массива, поэтому одинакова у всех запросов
+            for (size_t length = forbidden_domains_.size(); length > 1;) {
+                const size_t half = length / 2;
+                length -= half;
+                for (size_t i = 0; i < count; ++i) {
+                    if (!IsLess(queries[i], keys[i], bases[i] + half)) {
+                        bases[i] += half;
+                    }
+                    Prefetch(&keys_[bases[i] + length / 2]);
+                }
+            }
+
+            for (size_t i = 0; i < count; ++i) {
+                // bases[i] - последний элемент, не больший запроса, если такой есть
+                const size_t upper_bound = bases[i] + !IsLess(queries[i], keys[i], bases[i]);
+                verdicts[first + i] = upper_bound != 0 && Covers(upper_bound - 1, queries[i]);
+            }
+        }
+    }
+
+    // То же, что IsForbiddenBatch, но соединением слиянием: запросы сортируются в порядке правил и
+    // проходятся вместе с правилами одним проходом, ответы раскладываются в исходном порядке. Выгодно,
+    // когда запросов сравнимо с правилами: оба массива читаются последовательно, а не вразброс.
+    // Проход по правилам галопирует, поэтому и при немногих запросах он не медленнее бинарных поисков
+    void IsForbiddenJoin(std::span<const Domain> domains, std::span<bool> verdicts) const {
+        assert(domains.size() == verdicts.size());
+        DOMAIN_FILTER_PHASE("join"sv);
+        std::vector<std::pair<uint64_t, uint32_t>> order(domains.size());
+        for (size_t i = 0; i < domains.size(); ++i) {
+            order[i] = {domains[i].SortKey(), static_cast<uint32_t>(i)};
+        }
+        std::sort(order.begin(), order.end(), [&domains](const auto& lhs, const auto& rhs) {
+            return lhs.first != rhs.first ? lhs.first < rhs.first : domains[lhs.second] < domains[rhs.second];
+        });
+
+        // upper_bound - первое правило больше текущего запроса; с ростом запросов только растёт.
+        // Слияние замеряется группами по kJoinSampleSize запросов: вызов один на всю пачку
+        static constexpr size_t kJoinSampleSize = 1024;
+        size_t upper_bound = 0;
+        for (size_t first = 0; first < order.size(); first += kJoinSampleSize) {
+            const size_t last = std::min(order.size(), first + kJoinSampleSize);
+            DOMAIN_FILTER_RECORD(BatchLookups, last - first);
+            for (size_t i = first; i < last; ++i) {
+                const auto [key, index] = order[i];
+                const Domain& domain = domains[index];
+                size_t step = 1;
+                while (upper_bound + step <= forbidden_domains_.size() &&
+                       !IsLess(domain, key, upper_bound + step - 1)) {
+                    upper_bound += step;
+                    step *= 2;
+                }
+                // ответ в [upper_bound, upper_bound + step)
+                for (step /= 2; step > 0; step /= 2) {
+                    if (upper_bound + step <= forbidden_domains_.size() &&
+                        !IsLess(domain, key, upper_bound + step - 1)) {
+                        upper_bound += step;
+                    }
+                }
+                verdicts[index] = upper_bound != 0 && Covers(upper_bound - 1, domain);
+            }
+        }
+    }
+private:
+    // сортирует вектор доменов, убирает дубликаты и лишние поддомены
+    void PrepareForbiddenDomains() const {
+        {
+            DOMAIN_FILTER_PHASE("sort"sv);
+            std::sort(forbidden_domains_.begin(), forbidden_domains_.end());
+        }
+        RemoveCoveredDomains();
+    }
+
+    // Сортирует правила, убирая дубликаты и всё, что уже покрыто правилами kSubtree. Правило kExact может
+    // оставаться предком других правил, но между правилом kSubtree и его поддоменами правил нет, поэтому
+    // ближайший не больший запроса элемент по-прежнему единственный кандидат на совпадение
+    void PrepareForbiddenRules(std::vector<ForbiddenRule> rules) const {
+        {
+            DOMAIN_FILTER_PHASE("sort"sv);
+            // при равных именах правило kSubtree идёт первым и поглощает kExact
+            std::sort(rules.begin(), rules.end(), [](const ForbiddenRule& lhs, const ForbiddenRule& rhs) {
+                return lhs.domain < rhs.domain || (!(rhs.domain < lhs.domain) && lhs.mode < rhs.mode);
+            });
+        }
+
+        DOMAIN_FILTER_PHASE("unique"sv);
+        std::vector<bool> exact_rules;
+        std::optional<size_t> last_subtree;
+        for (ForbiddenRule& rule : rules) {
+            if ((last_subtree && rule.domain.IsSubdomain(forbidden_domains_[*last_subtree])) ||
+                (!forbidden_domains_.empty() && forbidden_domains_.back() == rule.domain)) {
+                continue;
+            }
+            if (rule.mode == MatchMode::kSubtree) {
+                last_subtree = forbidden_domains_.size();
+            }
+            exact_rules.push_back(rule.mode == MatchMode::kExact);
+            forbidden_domains_.push_back(std::move(rule.domain));
+        }
+        // без правил kExact поиск не обращается к режимам вовсе
+        if (std::find(exact_rules.begin(), exact_rules.end(), true) != exact_rules.end()) {
+            exact_rules_ = std::move(exact_rules);
+        }
+
+        BuildKeys();
+    }
+
+    void ParallelSortForbiddenDomains(WorkStealingPool& pool) const {
+        static constexpr size_t kMinChunkSize = 16 * 1024;
+        DOMAIN_FILTER_PHASE("sort"sv);
+
+        const size_t size = forbidden_domains_.size();
+        const size_t chunk_size = std::max(kMinChunkSize, (size + 4 * pool.ThreadCount() - 1) / (4 * pool.ThreadCount()));
+        const size_t chunks_count = (size + chunk_size - 1) / chunk_size;
+        auto chunk_begin = [&](size_t chunk) {
+            return forbidden_domains_.begin() + std::min(size, chunk * chunk_size);
+        };
+
+        pool.ParallelFor(0, chunks_count, 1, [&](size_t first, size_t last) {
+            for (size_t chunk = first; chunk < last; ++chunk) {
+                std::sort(chunk_begin(chunk), chunk_begin(chunk + 1));
+            }
+        });
+        // на каждом шаге сливаются пары соседних отсортированных групп по width частей
+        for (size_t width = 1; width < chunks_count; width *= 2) {
+            pool.ParallelFor(0, (chunks_count + 2 * width - 1) / (2 * width), 1, [&](size_t first, size_t last) {
+                for (size_t pair = first; pair < last; ++pair) {
+                    const size_t left = pair * 2 * width;
+                    std::inplace_merge(chunk_begin(left), chunk_begin(left + width), chunk_begin(left + 2 * width));
+                }
+            });
+        }
+    }
+
+    // убирает дубликаты и поддомены уже запрещённых доменов из отсортированного массива
+    void RemoveCoveredDomains() const {
+        {
+            DOMAIN_FILTER_PHASE("unique"sv);
+            auto new_end_iter = std::unique(forbidden_domains_.begin(), forbidden_domains_.end(), 
+                [](const Domain& lhs, const Domain& rhs) {
+                    return lhs.IsSubdomain(rhs) || rhs.IsSubdomain(lhs);
+            });
+            forbidden_domains_.erase(new_end_iter, forbidden_domains_.end());
+        }
+
+        BuildKeys();
+    }
+
+    void BuildKeys() const {
+        DOMAIN_FILTER_PHASE("sort_keys"sv);
+        keys_.resize(forbidden_domains_.size());
+        std::transform(forbidden_domains_.begin(), forbidden_domains_.end(), keys_.begin(),
+                       [](const Domain& domain) { return domain.SortKey(); });
+    }
+
+    // запрещает ли правило index домен domain
+    bool Covers(size_t index, const Domain& domain) const noexcept {
+        return exact_rules_.empty() || !exact_rules_[index] ? domain.IsSubdomain(forbidden_domains_[index])
+                                                            : domain == forbidden_domains_[index];
+    }
+
+    // domain < forbidden_domains_[index]; обычно решается плотным массивом ключей без обращения к именам
+    bool IsLess(const Domain& domain, uint64_t key, size_t index) const noexcept {
+        return key != keys_[index] ? key < keys_[index] : domain < forbidden_domains_[index];
+    }
+
+    mutable std::vector<Domain, HugePageAllocator<Domain>> forbidden_domains_;
+    // ключи SortKey элементов forbidden_domains_
+    mutable std::vector<uint64_t, HugePageAllocator<uint64_t>> keys_;
+    // режимы правил: true - kExact; пусто, если все правила kSubtree
+    mutable std::vector<bool> exact_rules_;
+};
+
+// Те же правила, что у DomainChecker, но упакованные в корзины по kBucketSize с фронтальным
+// кодированием: соседние в порядке Domain::operator< имена делят длинный общий конец (всё под
+// ".example.com"), и каждое имя корзины хранит только длину общего с предыдущим конца и своё начало.
+// Первое имя корзины записано целиком, для первых имён хранятся смещения и ключи сортировки, по ним
+// идёт бинарный поиск корзины, а затем корзина просматривается от начала. Имена раскодируются в буфер,
+// выровненный по правому краю, поэтому общий конец остаётся на месте и не копируется
+class FrontCodedDomainChecker {
+public:
+    static constexpr size_t kBucketSize = 16;
+
+    template <typename InputIter>
+    FrontCodedDomainChecker(InputIter begin, InputIter end) : FrontCodedDomainChecker(DomainChecker(begin, end)) {
+    }
+
+    explicit FrontCodedDomainChecker(const DomainChecker& checker) : rules_count_(checker.RuleCount()) {
+        DOMAIN_FILTER_PHASE("front_coding"sv);
+        std::string data;
+        std::string_view previous;
+        for (size_t i = 0; i < rules_count_; ++i) {
+            std::string_view name = checker.Rule(i).Name();
+            const uint64_t exact = checker.IsExactRule(i);
+            if (i % kBucketSize == 0) {
+                bucket_offsets_.push_back(data.size());
+                head_keys_.push_back(checker.Rule(i).SortKey());
+                AppendVarint(data, name.size() << 1 | exact);
+            } else {
+                size_t shared = 0;
+                const size_t limit = std::min(name.size(), previous.size());
+                while (shared < limit && name[name.size() - 1 - shared] == previous[previous.size() - 1 - shared]) {
+                    ++shared;
+                }
+                AppendVarint(data, shared);
+                AppendVarint(data, (name.size() - shared) << 1 | exact);
+                name = name.substr(0, name.size() - shared);
+            }
+            data.append(name);
+            previous = checker.Rule(i).Name();
+            max_name_size_ = std::max(max_name_size_, previous.size());
+        }
+        data_ = std::move(data);
+        data_.shrink_to_fit();
+    }
+
+    bool IsForbidden(const Domain& domain) const {
+        DOMAIN_FILTER_SAMPLE(Lookups, 1);
+        const std::string_view query = domain.Name();
+        const uint64_t key = domain.SortKey();
+        // последняя корзина, чьё первое имя не больше запроса
+        size_t upper_bound = 0;
+        for (size_t length = bucket_offsets_.size(); length > 0;) {
+            const size_t half = length / 2;
+            if (!IsLessThanHead(query, key, upper_bound + half)) {
+                upper_bound += half + 1;
+                length -= half + 1;
+            } else {
+                length = half;
+            }
+        }
+        if (upper_bound == 0) {
+            return false;
+        }
+
+        thread_local std::string buffer;
+        if (buffer.size() < max_name_size_) {
+            buffer.resize(max_name_size_);
+        }
+        char* const buffer_end = buffer.data() + buffer.size();
+        const size_t bucket = upper_bound - 1;
+        const char* data = data_.data() + bucket_offsets_[bucket];
+        const size_t count = std::min(kBucketSize, rules_count_ - bucket * kBucketSize);
+        // подходит ли запросу последнее имя корзины, не большее запроса
+        bool covered = false;
+        size_t name_size = 0;
+        for (size_t i = 0; i < count; ++i) {
+            const size_t shared = i == 0 ? 0 : DecodeVarint(data);
+            const uint64_t own_and_flag = DecodeVarint(data);
+            const size_t own = own_and_flag >> 1;
+            std::copy(data, data + own, buffer_end - shared - own);
+            data += own;
+            name_size = shared + own;
+            const std::string_view name(buffer_end - name_size, name_size);
+            if (Domain::Less(query, name)) {
+                break;
+            }
+            covered = (own_and_flag & 1) != 0 ? query == name : Domain::IsSubdomainOf(query, name);
+        }
+        return covered;
+    }
+
+    void IsForbiddenBatch(std::span<const Domain> domains, std::span<bool> verdicts) const {
+        assert(domains.size() == verdicts.size());
+        for (size_t i = 0; i < domains.size(); ++i) {
+            verdicts[i] = IsForbidden(domains[i]);
+        }
+    }
+
+    size_t RuleCount() const noexcept {
+        return rules_count_;
+    }
+
+    size_t MemoryUsage() const noexcept {
+        return data_.capacity() + bucket_offsets_.capacity() * sizeof(uint64_t) + head_keys_.capacity() * sizeof(uint64_t);
+    }
+private:
+    // данные строятся этим же классом, поэтому при разборе границы не проверяются
+    static uint64_t DecodeVarint(const char*& data) noexcept {
+        uint64_t value = 0;
+        for (int shift = 0;; shift += 7) {
+            const unsigned char byte = static_cast<unsigned char>(*data++);
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if (byte < 0x80) {
+                return value;
+            }
+        }
+    }
+
+    std::string_view HeadName(size_t bucket) const noexcept {
+        const char* data = data_.data() + bucket_offsets_[bucket];
+        const size_t size = DecodeVarint(data) >> 1;
+        return std::string_view(data, size);
+    }
+
+    bool IsLessThanHead(std::string_view query, uint64_t key, size_t bucket) const noexcept {
+        return key != head_keys_[bucket] ? key < head_keys_[bucket] : Domain::Less(query, HeadName(bucket));
+    }
+
+    size_t rules_count_;
+    size_t max_name_size_ = 0;
+    std::string data_;
+    std::vector<uint64_t> bucket_offsets_;
+    std::vector<uint64_t> head_keys_;
+};
+
+// Проверка доменов, разбитая на независимые части по метке верхнего уровня. Домен и все его
+// поддомены имеют одну и ту же метку верхнего уровня, поэтому запрос ищется только в своей части:
+// массивы частей небольшие и остаются в кэше, части строятся параллельно и перезагружаются по отдельности
+class ShardedDomainChecker {
+public:
+    template <typename InputIter>
+    ShardedDomainChecker(InputIter begin, InputIter end) {
+        std::unordered_map<std::string, std::vector<Domain>, LabelHash, std::equal_to<>> groups;
+        for (; begin != end; ++begin) {
+            Domain domain(*begin);
+            const std::string_view label = domain.TopLevelLabel();
+            auto group = groups.find(label);
+            if (group == groups.end()) {
+                group = groups.emplace(std::string(label), std::vector<Domain>{}).first;
+            }
+            group->second.push_back(std::move(domain));
+        }
+        BuildShards(groups);
+    }
+
+    bool IsForbidden(const Domain& domain) const {
+        const auto shard = shards_.find(domain.TopLevelLabel());
+        return shard != shards_.end() && shard->second.IsForbidden(domain);
+    }
+
+    // заменяет запрещённые домены одной части, не затрагивая остальные;
+    // не должен вызываться одновременно с проверками
+    template <typename InputIter>
+    void ReloadShard(std::string_view label, InputIter begin, InputIter end) {
+        DomainChecker checker(begin, end);
+        auto shard = shards_.find(label);
+        if (shard == shards_.end()) {
+            shards_.emplace(std::string(label), std::move(checker));
+        } else {
+            shard->second = std::move(checker);
+        }
+    }
+
+    size_t ShardCount() const noexcept {
+        return shards_.size();
+    }
+private:
+    struct LabelHash {
+        using is_transparent = void;
+
+        size_t operator()(std::string_view label) const noexcept {
+            return std::hash<std::string_view>{}(label);
+        }
+    };
+
+    using Groups = std::unordered_map<std::string, std::vector<Domain>, LabelHash, std::equal_to<>>;
+
+    // строит части в нескольких потоках, каждый поток забирает следующую необработанную группу
+    void BuildShards(Groups& groups) {
+        std::vector<std::pair<const std::string, std::vector<Domain>>*> tasks;
+        tasks.reserve(groups.size());
+        for (auto& group : groups) {
+            tasks.push_back(&group);
+        }
+
+        std::vector<std::optional<DomainChecker>> checkers(tasks.size());
+        std::atomic<size_t> next_task = 0;
+        auto worker = [&] {
+            for (size_t i = next_task++; i < tasks.size(); i = next_task++) {
+                checkers[i].emplace(tasks[i]->second.begin(), tasks[i]->second.end());
+            }
+        };
+        const size_t threads_count = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), tasks.size());
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < threads_count; ++i) {
+            threads.emplace_back(worker);
+        }
+        worker();
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+
+        for (size_t i = 0; i < tasks.size(); ++i) {
+            shards_.emplace(tasks[i]->first, std::move(*checkers[i]));
+        }
+    }
+
+    std::unordered_map<std::string, DomainChecker, LabelHash, std::equal_to<>> shards_;
+};
+
+// Недетерминированный автомат для набора шаблонов имён, моделируемый параллельно по битам (Shift-And).
+// Шаблон сопоставляется с именем целиком: '*' - любая, в том числе пустая, последовательность символов,
+// '?' - ровно один символ, кроме точки, остальные символы обозначают сами себя. Состояние k шаблона
+// означает "прочитаны первые k элементов шаблона", все состояния всех шаблонов лежат в одном битовом векторе
+class PatternAutomaton {
+public:
+    explicit PatternAutomaton(const std::vector<std::string>& patterns) {
+        std::vector<std::string> normalized;
+        for (std::string_view pattern : patterns) {
+            // подряд идущие '*' равносильны одной, а автомату нужна одна
+            std::string& tokens = normalized.emplace_back();
+            for (char c : pattern) {
+                if (c != '*' || tokens.empty() || tokens.back() != '*') {
+                    tokens += c;
+                }
+            }
+            states_count_ += tokens.size() + 1;
+        }
+
+        words_count_ = (states_count_ + kWordBits - 1) / kWordBits;
+        starts_.assign(words_count_, 0);
+        stars_.assign(words_count_, 0);
+        finals_.assign(words_count_, 0);
+        char_masks_.assign(256 * words_count_, 0);
+        size_t state = 0;
+        for (const std::string& tokens : normalized) {
+            SetBit(starts_, state);
+            for (char token : tokens) {
+                ++state;
+                if (token == '*') {
+                    SetBit(stars_, state);
+                    continue;
+                }
+                for (int c = 0; c < 256; ++c) {
+                    if (token == '?' ? c != static_cast<unsigned char>('.') : c == static_cast<unsigned char>(token)) {
+                        SetBit(char_masks_.data() + c * words_count_, state);
+                    }
+                }
+            }
+            SetBit(finals_, state);
+            ++state;
+        }
+    }
+
+    bool Empty() const noexcept {
+        return states_count_ == 0;
+    }
+
+    // true, если name подходит хотя бы под один шаблон
+    bool Matches(std::string_view name) const {
+        // буферы состояний живут в потоке и только растут: проверка не обращается к куче
+        thread_local std::vector<Word> active;
+        thread_local std::vector<Word> next;
+        active.assign(starts_.begin(), starts_.end());
+        if (next.size() < words_count_) {
+            next.resize(words_count_);
+        }
+        CloseOverStars(active);
+        for (char c : name) {
+            const Word* mask = char_masks_.data() + static_cast<unsigned char>(c) * words_count_;
+            Word carry = 0;
+            Word any_active = 0;
+            for (size_t i = 0; i < words_count_; ++i) {
+                next[i] = (((active[i] << 1) | carry) & mask[i]) | (active[i] & stars_[i]);
+                carry = active[i] >> (kWordBits - 1);
+                any_active |= next[i];
+            }
+            if (any_active == 0) {
+                return false;
+            }
+            active.swap(next);
+            CloseOverStars(active);
+        }
+        for (size_t i = 0; i < words_count_; ++i) {
+            if (active[i] & finals_[i]) {
+                return true;
+            }
+        }
+        return false;
+    }
+private:
+    using Word = uint64_t;
+    static constexpr size_t kWordBits = sizeof(Word) * CHAR_BIT;
+
+    static void SetBit(std::vector<Word>& bits, size_t index) noexcept {
+        SetBit(bits.data(), index);
+    }
+
+    static void SetBit(Word* bits, size_t index) noexcept {
+        bits[index / kWordBits] |= Word{1} << (index % kWordBits);
+    }
+
+    // состояние '*' активно сразу, как только активно предыдущее: звёздочка может ничего не поглощать
+    void CloseOverStars(std::vector<Word>& active) const noexcept {
+        Word carry = 0;
+        for (size_t i = 0; i < words_count_; ++i) {
+            const Word shifted = (active[i] << 1) | carry;
+            carry = active[i] >> (kWordBits - 1);
+            active[i] |= shifted & stars_[i];
+        }
+    }
+
+    size_t states_count_ = 0;
+    size_t words_count_ = 0;
+    std::vector<Word> starts_;
+    std::vector<Word> stars_;
+    std::vector<Word> finals_;
+    // для каждого байта - состояния, в которые можно перейти по нему из предыдущего
+    std::vector<Word> char_masks_;
+};
+
+// Проверка по расширенным правилам. Правило без особых символов запрещает домен и все его поддомены,
+// а правило с префиксом '=' - только сам домен; оба проверяются обычным DomainChecker. Правило с '*'
+// или '?' запрещает имена, целиком подходящие под шаблон (см. PatternAutomaton). Шаблоны собираются
+// в автоматы, сгруппированные по последней метке шаблона, если в ней нет подстановочных символов,
+// так что запрос прогоняется только через автомат своей метки верхнего уровня и общий автомат
+class ExtendedDomainChecker {
+public:
+    template <typename InputIter>
+    ExtendedDomainChecker(InputIter begin, InputIter end) : ExtendedDomainChecker(SplitRules(begin, end)) {
+    }
+
+    bool IsForbidden(const Domain& domain) const {
+        return suffix_checker_.IsForbidden(domain) || MatchesPatterns(domain);
+    }
+
+    // запросы сначала проверяются пакетно обычным индексом, автоматы - только для оставшихся
+    void IsForbiddenBatch(std::span<const Domain> domains, std::span<bool> verdicts) const {
+        suffix_checker_.IsForbiddenBatch(domains, verdicts);
+        if (pattern_groups_.empty()) {
+            return;
+        }
+        for (size_t i = 0; i < domains.size(); ++i) {
+            verdicts[i] = verdicts[i] || MatchesPatterns(domains[i]);
+        }
+    }
+private:
+    struct LabelHash {
+        using is_transparent = void;
+
+        size_t operator()(std::string_view label) const noexcept {
+            return std::hash<std::string_view>{}(label);
+        }
+    };
+
+    // обычные правила и шаблоны, разложенные по последней метке
+    struct SplitResult {
+        std::vector<ForbiddenRule> suffix_rules;
+        std::map<std::string, std::vector<std::string>, std::less<>> patterns;
+    };
+
+    template <typename InputIter>
+    static SplitResult SplitRules(InputIter begin, InputIter end) {
+        SplitResult result;
+        for (; begin != end; ++begin) {
+            Domain rule(*begin);
+            const std::string_view name = rule.Name();
+            if (name.find_first_of("*?"sv) != std::string_view::npos) {
+                const std::string_view label = rule.TopLevelLabel();
+                const bool is_literal_label = label.find_first_of("*?"sv) == std::string_view::npos;
+                result.patterns[std::string(is_literal_label ? label : kAnyLabel)].emplace_back(name.substr(name.starts_with('=')));
+            } else if (name.starts_with('=')) {
+                result.suffix_rules.push_back({Domain(name.substr(1)), MatchMode::kExact});
+            } else {
+                result.suffix_rules.push_back({std::move(rule), MatchMode::kSubtree});
+            }
+        }
+        return result;
+    }
+
+    explicit ExtendedDomainChecker(SplitResult rules)
+        : suffix_checker_(rules.suffix_rules.begin(), rules.suffix_rules.end()) {
+        for (const auto& [label, patterns] : rules.patterns) {
+            pattern_groups_.emplace(label, PatternAutomaton(patterns));
+        }
+    }
+
+    bool MatchesPatterns(const Domain& domain) const {
+        if (pattern_groups_.empty()) {
+            return false;
+        }
+        const auto group = pattern_groups_.find(domain.TopLevelLabel());
+        if (group != pattern_groups_.end() && group->second.Matches(domain.Name())) {
+            return true;
+        }
+        const auto any_label_group = pattern_groups_.find(kAnyLabel);
+        return any_label_group != pattern_groups_.end() && any_label_group->second.Matches(domain.Name());
+    }
+
+    // группа шаблонов с подстановочными символами в последней метке; сама метка без точек так выглядеть не может
+    static constexpr std::string_view kAnyLabel = "*"sv;
+
+    DomainChecker suffix_checker_;
+    std::unordered_map<std::string, PatternAutomaton, LabelHash, std::equal_to<>> pattern_groups_;
+};
+
+// Именованный список запрещённых доменов, например "malware" или "ads"
+struct DomainList {
+    std::string name;
+    std::vector<Domain> domains;
+};
+
+// Проверка сразу по нескольким спискам. Каждое правило помечено маской списков, в которых оно есть,
+// а поиск возвращает объединение масок всех правил, покрывающих запрос. Поддомены правил других
+// списков здесь не выбрасываются, поэтому для каждого правила хранится ближайшее правило-предок
+// и объединённая маска всей цепочки предков
+class MultiListDomainChecker {
+public:
+    using ListMask = uint64_t;
+    static constexpr size_t kMaxLists = sizeof(ListMask) * CHAR_BIT;
+
+    explicit MultiListDomainChecker(const std::vector<DomainList>& lists) {
+        if (lists.size() > kMaxLists) {
+            throw std::invalid_argument("too many domain lists: "s + std::to_string(lists.size()));
+        }
+
+        std::vector<std::pair<Domain, ListMask>> rules;
+        for (size_t i = 0; i < lists.size(); ++i) {
+            list_names_.push_back(lists[i].name);
+            for (const Domain& domain : lists[i].domains) {
+                rules.emplace_back(domain, ListMask{1} << i);
+            }
+        }
+        std::sort(rules.begin(), rules.end(), [](const auto& lhs, const auto& rhs) {
+            return lhs.first < rhs.first;
+        });
+        PrepareRules(rules);
+    }
+
+    // маска списков, правила которых покрывают domain; 0, если запрос не запрещён ни одним списком
+    ListMask Lookup(const Domain& domain) const {
+        const auto find_domain = std::upper_bound(domains_.begin(), domains_.end(), domain);
+        size_t index = find_domain == domains_.begin() ? kNoRule : find_domain - domains_.begin() - 1;
+        // правило-предок запроса, если оно есть, - предок и найденного соседа
+        while (index != kNoRule && !domain.IsSubdomain(domains_[index])) {
+            index = parents_[index];
+        }
+        return index == kNoRule ? 0 : masks_[index];
+    }
+
+    size_t ListCount() const noexcept {
+        return list_names_.size();
+    }
+
+    const std::string& ListName(size_t index) const {
+        return list_names_.at(index);
+    }
+private:
+    static constexpr size_t kNoRule = SIZE_MAX;
+
+    // объединяет одинаковые правила и для каждого правила находит ближайшего предка
+    void PrepareRules(std::vector<std::pair<Domain, ListMask>>& rules) {
+        std::vector<ListMask> own_masks;
+        std::vector<size_t> ancestors;
+        for (auto& [domain, mask] : rules) {
+            if (!domains_.empty() && domains_.back() == domain) {
+                own_masks.back() |= mask;
+                continue;
+            }
+            while (!ancestors.empty() && !domain.IsSubdomain(domains_[ancestors.back()])) {
+                ancestors.pop_back();
+            }
+            parents_.push_back(ancestors.empty() ? kNoRule : ancestors.back());
+            own_masks.push_back(mask);
+            ancestors.push_back(domains_.size());
+            domains_.push_back(std::move(domain));
+        }
+        // предок всегда стоит раньше потомка, поэтому его маска уже посчитана
+        masks_.resize(domains_.size());
+        for (size_t i = 0; i < domains_.size(); ++i) {
+            masks_[i] = own_masks[i] | (parents_[i] == kNoRule ? 0 : masks_[parents_[i]]);
+        }
+    }
+
+    std::vector<Domain> domains_;
+    std::vector<size_t> parents_;
+    // маски правил вместе с масками всех их предков
+    std::vector<ListMask> masks_;
+    std::vector<std::string> list_names_;
+};
+
+// Порядковый номер текущего потока, по которому потоки раскладываются по частям счётчиков
+inline size_t ThreadIndex() noexcept {
+    static std::atomic<size_t> next_index = 0;
+    thread_local const size_t index = next_index++;
+    return index;
+}
+
+// Счётчики срабатываний правил, разделённые между потоками: поток увеличивает счётчики только своей
+// части, поэтому параллельные проверки не борются за одни и те же строки кэша. Суммы по частям
+// считаются только при чтении статистики
+class ShardedHitCounter {
+public:
+    explicit ShardedHitCounter(size_t rules_count, size_t shards_count = std::max(1u, std::thread::hardware_concurrency()))
+        : rules_count_(rules_count),
+          shards_count_(shards_count),
+          lines_per_shard_((rules_count + kCountersPerLine - 1) / kCountersPerLine),
+          lines_(std::make_unique<CounterLine[]>(shards_count_ * lines_per_shard_)) {
+    }
+
+    void Hit(size_t rule) noexcept {
+        Counter(ThreadIndex() % shards_count_, rule).fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint64_t Count(size_t rule) const noexcept {
+        uint64_t count = 0;
+        for (size_t shard = 0; shard < shards_count_; ++shard) {
+            count += Counter(shard, rule).load(std::memory_order_relaxed);
+        }
+        return count;
+    }
+
+    // не более top_count сработавших правил в порядке убывания числа срабатываний
+    std::vector<std::pair<size_t, uint64_t>> Top(size_t top_count) const {
+        std::vector<std::pair<size_t, uint64_t>> hits;
+        for (size_t rule = 0; rule < rules_count_; ++rule) {
+            if (const uint64_t count = Count(rule)) {
+                hits.emplace_back(rule, count);
+            }
+        }
+        top_count = std::min(top_count, hits.size());
+        std::partial_sort(hits.begin(), hits.begin() + top_count, hits.end(), [](const auto& lhs, const auto& rhs) {
+            return lhs.second > rhs.second || (lhs.second == rhs.second && lhs.first < rhs.first);
+        });
+        hits.resize(top_count);
+        return hits;
+    }
+private:
+    static constexpr size_t kCountersPerLine = 8;
+
+    // Части лежат в одном массиве строк кэша, и каждая занимает целое число строк, поэтому
+    // счётчики разных частей никогда не делят строку
+    struct alignas(64) CounterLine {
+        std::atomic<uint64_t> counters[kCountersPerLine];
+    };
+    static_assert(sizeof(CounterLine) == 64);
+
+    std::atomic<uint64_t>& Counter(size_t shard, size_t rule) const noexcept {
+        return lines_[shard * lines_per_shard_ + rule / kCountersPerLine].counters[rule % kCountersPerLine];
+    }
+
+    size_t rules_count_;
+    size_t shards_count_;
+    size_t lines_per_shard_;
+    std::unique_ptr<CounterLine[]> lines_;
+};
+
+// Кэш ответов для повторяющихся запросов. Множественно-ассоциативный: хэш имени выбирает набор
+// из 8 слов в одной строке кэша процессора, слово целиком хранит запись - старшие биты хэша, поколение,
+// ответ и бит обращения. Все операции - отдельные атомарные чтения и записи слов без блокировок,
+// а бит обращения записывается, только если он ещё не стоит, поэтому горячие записи лишь читаются.
+// Вытеснение - CLOCK внутри набора: запись с битом обращения получает второй шанс.
+// Перезагрузка списка делает Invalidate: записи прошлых поколений перестают совпадать
+// и занимаются первыми. Совпадение хэшей разных имён возможно, но вероятность - около 2^-40
+class QueryCache {
+public:
+    static constexpr size_t kWays = 8;
+
+    // capacity - примерное число записей, округляется вверх до степени двойки
+    explicit QueryCache(size_t capacity, size_t shards_count = std::max(1u, std::thread::hardware_concurrency()))
+        : sets_count_(std::bit_ceil(std::max<size_t>(1, (capacity + kWays - 1) / kWays))),
+          sets_(std::make_unique<Set[]>(sets_count_)),
+          counters_(shards_count) {
+    }
+
+    static uint64_t Hash(const Domain& domain) noexcept {
+        return std::hash<std::string_view>{}(domain.Name());
+    }
+
+    // текущее поколение; читается до того, как взять проверяющий объект, ответ которого попадёт в кэш
+    uint32_t Generation() const noexcept {
+        return generation_.load(std::memory_order_acquire);
+    }
+
+    // вызывается после того, как новый список опубликован
+    void Invalidate() noexcept {
+        uint32_t generation = generation_.load(std::memory_order_relaxed);
+        do {
+            if (((generation + 1) & kGenerationMask) == 0) {
+                // счётчик поколений сделал круг: стираем всё, чтобы старые записи не ожили
+                for (size_t i = 0; i < sets_count_; ++i) {
+                    for (std::atomic<uint64_t>& way : sets_[i].ways) {
+                        way.store(0, std::memory_order_relaxed);
+                    }
+                }
+            }
+        } while (!generation_.compare_exchange_weak(generation, NextGeneration(generation), std::memory_order_release,
+                                                    std::memory_order_relaxed));
+    }
+
+    // ответ из кэша, а если его нет - lookup(), запомненный для поколения generation
+    template <typename Lookup>
+    bool GetOrCompute(const Domain& domain, uint32_t generation, Lookup&& lookup) {
+        const uint64_t hash = Hash(domain);
+        if (const std::optional<bool> verdict = Find(hash, generation)) {
+            return *verdict;
+        }
+        const bool verdict = lookup();
+        Insert(hash, generation, verdict);
+        return verdict;
+    }
+
+    std::optional<bool> Find(uint64_t hash, uint32_t generation) noexcept {
+        Set& set = sets_[hash & (sets_count_ - 1)];
+        const uint64_t key = Key(hash, generation);
+        for (std::atomic<uint64_t>& way : set.ways) {
+            const uint64_t word = way.load(std::memory_order_relaxed);
+            if ((word & kKeyMask) == key) {
+                if ((word & kReferenced) == 0) {
+                    way.fetch_or(kReferenced, std::memory_order_relaxed);
+                }
+                counters_[ThreadIndex() % counters_.size()].hits.fetch_add(1, std::memory_order_relaxed);
+                return (word & kVerdict) != 0;
+            }
+        }
+        counters_[ThreadIndex() % counters_.size()].misses.fetch_add(1, std::memory_order_relaxed);
+        return std::nullopt;
+    }
+
+    void Insert(uint64_t hash, uint32_t generation, bool verdict) noexcept {
+        Set& set = sets_[hash & (sets_count_ - 1)];
+        const uint64_t key = Key(hash, generation);
+        const uint64_t current = Key(0, Generation()) & kGenerationBits;
+        // сначала свободные и устаревшие записи
+        for (std::atomic<uint64_t>& way : set.ways) {
+            const uint64_t word = way.load(std::memory_order_relaxed);
+            if ((word & kKeyMask) == key) {
+                return;
+            }
+            if ((word & kGenerationBits) != current) {
+                way.store(key | (verdict ? kVerdict : 0), std::memory_order_relaxed);
+                return;
+            }
+        }
+        // стрелка CLOCK начинает с места, которое выбирают свободные биты хэша
+        for (size_t step = 0, way = (hash >> kTagShift) % kWays;; ++step, way = (way + 1) % kWays) {
+            const uint64_t word = set.ways[way].load(std::memory_order_relaxed);
+            if ((word & kReferenced) == 0 || step >= 2 * kWays) {
+                set.ways[way].store(key | (verdict ? kVerdict : 0), std::memory_order_relaxed);
+                return;
+            }
+            set.ways[way].fetch_and(~kReferenced, std::memory_order_relaxed);
+        }
+    }
+
+    uint64_t Hits() const noexcept {
+        return Sum(&Counters::hits);
+    }
+
+    uint64_t Misses() const noexcept {
+        return Sum(&Counters::misses);
+    }
+
+    double HitRate() const noexcept {
+        const uint64_t hits = Hits();
+        const uint64_t total = hits + Misses();
+        return total == 0 ? 0.0 : static_cast<double>(hits) / static_cast<double>(total);
+    }
+
+    size_t Capacity() const noexcept {
+        return sets_count_ * kWays;
+    }
+private:
+    // слово записи: тег (старшие 40 бит хэша) | поколение (22 бита) | ответ | бит обращения
+    static constexpr int kTagShift = 24;
+    static constexpr uint32_t kGenerationMask = (1u << 22) - 1;
+    static constexpr uint64_t kReferenced = 1;
+    static constexpr uint64_t kVerdict = 2;
+    static constexpr uint64_t kGenerationBits = uint64_t{kGenerationMask} << 2;
+    static constexpr uint64_t kKeyMask = ~(kReferenced | kVerdict);
+
+    struct alignas(64) Set {
+        std::array<std::atomic<uint64_t>, kWays> ways = {};
+    };
+
+    struct alignas(64) Counters {
+        std::atomic<uint64_t> hits = 0;
+        std::atomic<uint64_t> misses = 0;
+    };
+
+    static uint64_t Key(uint64_t hash, uint32_t generation) noexcept {
+        return (hash >> kTagShift) << kTagShift | uint64_t{generation & kGenerationMask} << 2;
+    }
+
+    // нулевое поколение не используется, чтобы пустые слова ничему не совпадали
+    static uint32_t NextGeneration(uint32_t generation) noexcept {
+        return std::max<uint32_t>(1, (generation + 1) & kGenerationMask);
+    }
+
+    uint64_t Sum(std::atomic<uint64_t> Counters::* counter) const noexcept {
+        uint64_t sum = 0;
+        for (const Counters& counters : counters_) {
+            sum += (counters.*counter).load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+
+    size_t sets_count_;
+    std::unique_ptr<Set[]> sets_;
+    std::vector<Counters> counters_;
+    std::atomic<uint32_t> generation_ = 1;
+};
+
+// Проверка через QueryCache. Reload доступен, если он есть у Checker: сначала публикуется новый список,
+// затем сбрасывается кэш, поэтому ответ старого списка не может попасть в кэш с новым поколением
+template <typename Checker>
+class CachedDomainChecker {
+public:
+    CachedDomainChecker(Checker& checker, size_t capacity) : checker_(checker), cache_(capacity) {
+    }
+
+    bool IsForbidden(const Domain& domain) const {
+        return cache_.GetOrCompute(domain, cache_.Generation(), [&] {
+            return checker_.IsForbidden(domain);
+        });
+    }
+
+    template <typename InputIter>
+    void Reload(InputIter begin, InputIter end) {
+        checker_.Reload(begin, end);
+        cache_.Invalidate();
+    }
+
+    const QueryCache& Cache() const noexcept {
+        return cache_;
+    }
+private:
+    Checker& checker_;
+    mutable QueryCache cache_;
+};
+
+// Печатает top_count самых частых правил checker в виде строк "<число срабатываний> <домен>"
+void WriteTopRules(const DomainChecker& checker, const ShardedHitCounter& hit_counter, size_t top_count,
+                   std::ostream& out) {
+    std::ostringstream report;
+    report << "top "sv << top_count << " rules:\n"sv;
+    for (const auto& [rule, count] : hit_counter.Top(top_count)) {
+        report << count << ' ' << checker.Rule(rule) << '\n';
+    }
+    out << report.str() << std::flush;
+}
+
+// Печатает счётчики cache одной строкой
+void WriteCacheStats(const QueryCache& cache, std::ostream& out) {
+    std::ostringstream report;
+    report << "cache: hits "sv << cache.Hits() << ", misses "sv << cache.Misses() << ", hit rate "sv
+           << cache.HitRate() << '\n';
+    out << report.str() << std::flush;
+}
+
+// Раз в interval печатает самые частые правила или счётчики кэша, пока не будет разрушен
+class PeriodicHitReport {
+public:
+    PeriodicHitReport(const DomainChecker& checker, const ShardedHitCounter& hit_counter,
+                      std::chrono::milliseconds interval, size_t top_count, std::ostream& out)
+        : PeriodicHitReport(interval, [&checker, &hit_counter, top_count, &out] {
+              WriteTopRules(checker, hit_counter, top_count, out);
+          }) {
+    }
+
+    PeriodicHitReport(const QueryCache& cache, std::chrono::milliseconds interval, std::ostream& out)
+        : PeriodicHitReport(interval, [&cache, &out] {
+              WriteCacheStats(cache, out);
+          }) {
+    }
+
+    PeriodicHitReport(const PeriodicHitReport&) = delete;
+    PeriodicHitReport& operator=(const PeriodicHitReport&) = delete;
+
+    ~PeriodicHitReport() {
+        {
+            std::lock_guard lock(mutex_);
+            stop_ = true;
+        }
+        stop_condition_.notify_one();
+        thread_.join();
+    }
+private:
+    PeriodicHitReport(std::chrono::milliseconds interval, std::function<void()> report)
+        : thread_([interval, report = std::move(report), this] {
+              std::unique_lock lock(mutex_);
+              while (!stop_condition_.wait_for(lock, interval, [this] { return stop_; })) {
+                  report();
+              }
+          }) {
+    }
+
+    std::mutex mutex_;
+    std::condition_variable stop_condition_;
+    bool stop_ = false;
+    std::thread thread_;
+};
+
+// Узлы NUMA и их процессоры. На системах без NUMA или вне Linux - один узел без списка процессоров
+class NumaTopology {
+public:
+    static NumaTopology SingleNode() {
+        NumaTopology topology;
+        topology.node_cpus_.emplace_back();
+        return topology;
+    }
+
+    // читает топологию из /sys/devices/system/node
+    static NumaTopology Detect() {
+        NumaTopology topology;
+#ifdef __linux__
+        std::error_code error;
+        std::map<size_t, std::vector<int>> nodes;
+        for (const auto& entry : std::filesystem::directory_iterator("/sys/devices/system/node"sv, error)) {
+            const std::string name = entry.path().filename().string();
+            size_t node = 0;
+            if (!name.starts_with("node"sv) ||
+                std::from_chars(name.data() + 4, name.data() + name.size(), node).ptr != name.data() + name.size()) {
+                continue;
+            }
+            std::ifstream cpulist(entry.path() / "cpulist");
+            std::string line;
+            if (getline(cpulist, line)) {
+                nodes[node] = ParseCpuList(line);
+            }
+        }
+        for (auto& [node, cpus] : nodes) {
+            topology.node_cpus_.push_back(std::move(cpus));
+        }
+#endif
+        if (topology.node_cpus_.empty()) {
+            return SingleNode();
+        }
+        return topology;
+    }
+
+    // разбирает список процессоров вида "0-3,8,10-11"
+    static std::vector<int> ParseCpuList(std::string_view list) {
+        std::vector<int> cpus;
+        while (!list.empty()) {
+            const std::string_view range = list.substr(0, list.find(','));
+            list.remove_prefix(std::min(list.size(), range.size() + 1));
+            int first = 0;
+            int last = 0;
+            const auto [first_end, first_error] = std::from_chars(range.data(), range.data() + range.size(), first);
+            if (first_error != std::errc{}) {
+                continue;
+            }
+            last = first;
+            if (first_end != range.data() + range.size() && *first_end == '-') {
+                std::from_chars(first_end + 1, range.data() + range.size(), last);
+            }
+            for (int cpu = first; cpu <= last; ++cpu) {
+                cpus.push_back(cpu);
+            }
+        }
+        return cpus;
+    }
+
+    size_t NodeCount() const noexcept {
+        return node_cpus_.size();
+    }
+
+    // узел, на процессоре которого сейчас выполняется поток
+    size_t CurrentNode() const noexcept {
+#ifdef __linux__
+        if (node_cpus_.size() > 1) {
+            const int cpu = sched_getcpu();
+            for (size_t node = 0; node < node_cpus_.size(); ++node) {
+                if (std::find(node_cpus_[node].begin(), node_cpus_[node].end(), cpu) != node_cpus_[node].end()) {
+                    return node;
+                }
+            }
+        }
+#endif
+        return 0;
+    }
+
+    // привязывает текущий поток к процессорам узла node; false, если это не удалось
+    bool PinCurrentThread(size_t node) const noexcept {
+#ifdef __linux__
+        if (node_cpus_[node].empty()) {
+            return false;
+        }
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (int cpu : node_cpus_[node]) {
+            CPU_SET(cpu, &cpus);
+        }
+        return sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+#else
+        static_cast<void>(node);
+        return false;
+#endif
+    }
+private:
+    NumaTopology() = default;
+
+    std::vector<std::vector<int>> node_cpus_;
+};
+
+// Копии неизменяемого индекса по одной на узел NUMA, чтобы потоки не платили за обращения к памяти
+// чужого узла. Каждая копия строится потоком, привязанным к своему узлу, и по правилу first touch
+// размещается в его памяти. Все копии поколения публикуются одним атомарным присваиванием, поэтому
+// читатель, взявший Snapshot, видит либо только старые копии, либо только новые
+class ReplicatedDomainChecker {
+public:
+    using Replicas = std::vector<DomainChecker>;
+
+    template <typename InputIter>
+    ReplicatedDomainChecker(NumaTopology topology, InputIter begin, InputIter end) : topology_(std::move(topology)) {
+        Reload(begin, end);
+    }
+
+    // строит новые копии на всех узлах и только затем подменяет ими старые
+    template <typename InputIter>
+    void Reload(InputIter begin, InputIter end) {
+        std::lock_guard lock(reload_mutex_);
+        const std::vector<Domain> domains(begin, end);
+        std::vector<std::optional<DomainChecker>> replicas(topology_.NodeCount());
+        std::vector<std::thread> builders;
+        for (size_t node = 0; node < replicas.size(); ++node) {
+            builders.emplace_back([this, node, &domains, &replicas] {
+                topology_.PinCurrentThread(node);
+                replicas[node].emplace(domains.begin(), domains.end());
+            });
+        }
+        for (std::thread& builder : builders) {
+            builder.join();
+        }
+
+        auto generation = std::make_shared<Replicas>();
+        generation->reserve(replicas.size());
+        for (std::optional<DomainChecker>& replica : replicas) {
+            generation->push_back(std::move(*replica));
+        }
+        replicas_.store(std::move(generation));
+        generation_.store(next_generation_.fetch_add(1) + 1, std::memory_order_release);
+    }
+
+    // Копия одного узла глазами одного потока. Атомарный shared_ptr в libstdc++ защищён блокировкой,
+    // и его загрузка на каждом запросе сталкивает все потоки на одной кэш-линии. Reader держит
+    // своё поколение и берёт Snapshot заново, только когда сменился номер поколения
+    class Reader {
+    public:
+        Reader(const ReplicatedDomainChecker& checker, size_t node) : checker_(&checker), node_(node) {
+        }
+
+        const DomainChecker& Current() {
+            // номер читается раньше копий: увидев новый номер, Snapshot вернёт не более старые копии
+            const uint64_t generation = checker_->Generation();
+            if (generation != generation_) {
+                replicas_ = checker_->Snapshot();
+                generation_ = generation;
+            }
+            return (*replicas_)[node_];
+        }
+
+        const ReplicatedDomainChecker& Checker() const noexcept {
+            return *checker_;
+        }
+    private:
+        const ReplicatedDomainChecker* checker_;
+        size_t node_;
+        uint64_t generation_ = 0;
+        std::shared_ptr<const Replicas> replicas_;
+    };
+
+    // текущее поколение копий; остаётся действительным и после Reload, пока его держат
+    std::shared_ptr<const Replicas> Snapshot() const {
+        return replicas_.load();
+    }
+
+    // номер последнего опубликованного поколения; номера не повторяются во всём процессе
+    uint64_t Generation() const noexcept {
+        return generation_.load(std::memory_order_acquire);
+    }
+
+    // Читает копию узла, на котором поток оказался при первом обращении к этому checker'у.
+    // Рабочие потоки сервера привязаны к узлам, поэтому узел определяется один раз
+    bool IsForbidden(const Domain& domain) const {
+        thread_local std::optional<Reader> reader;
+        if (!reader || &reader->Checker() != this) {
+            reader.emplace(*this, topology_.CurrentNode());
+        }
+        return reader->Current().IsForbidden(domain);
+    }
+
+    const NumaTopology& Topology() const noexcept {
+        return topology_;
+    }
+private:
+    inline static std::atomic<uint64_t> next_generation_ = 0;
+
+    NumaTopology topology_;
+    std::mutex reload_mutex_;
+    std::atomic<std::shared_ptr<const Replicas>> replicas_;
+    std::atomic<uint64_t> generation_ = 0;
+};
+
+// Приведение имён к каноническому ASCII-виду IDNA (ToASCII): метки с символами вне ASCII переводятся
+// в пуникод с префиксом "xn--", ASCII-метки и готовые "xn--" метки приводятся к нижнему регистру.
+// Так один и тот же домен в UTF-8 и в пуникоде даёт одинаковый ключ для DomainChecker.
+// Память не выделяется: результат собирается во внутреннем буфере, а пуникод последних меток
+// запоминается в небольшом кэше с прямым отображением. Полное отображение UTS #46 и нормализация NFC
+// не выполняются, к нижнему регистру приводятся только ASCII, Latin-1, греческий и кириллица.
+// Объект не потокобезопасен: у каждого потока свой конвертер
+class IdnaConverter {
+public:
+    static constexpr size_t kMaxNameSize = 255;
+    static constexpr size_t kMaxLabelSize = 63;
+
+    // Имя в ASCII; указывает на name, если оно уже каноническое, иначе - во внутренний буфер до следующего
+    // вызова. Метки с некорректным UTF-8 или длиннее kMaxLabelSize после перевода остаются как есть.
+    // Имя длиннее kMaxNameSize после перевода не переводится, но его латиница всё равно приводится
+    // к нижнему регистру: иначе разные написания одного имени получали бы разные ответы
+    std::string_view ToAscii(std::string_view name) {
+        if (std::none_of(name.begin(), name.end(), [](char c) { return IsNonAscii(c) || (c >= 'A' && c <= 'Z'); })) {
+            return name;
+        }
+        size_t size = 0;
+        for (size_t label_begin = 0; label_begin <= name.size();) {
+            const size_t dot = std::min(name.find('.', label_begin), name.size());
+            const std::string_view label = name.substr(label_begin, dot - label_begin);
+            const bool is_ascii = std::none_of(label.begin(), label.end(), IsNonAscii);
+            const std::string_view converted = is_ascii ? label : ConvertLabel(label);
+            if (size + converted.size() + (dot < name.size()) > name_.size()) {
+                long_name_.resize(name.size());
+                std::transform(name.begin(), name.end(), long_name_.begin(), LowerAscii);
+                return long_name_;
+            }
+            std::transform(converted.begin(), converted.end(), name_.begin() + size, LowerAscii);
+            size += converted.size();
+            if (dot < name.size()) {
+                name_[size++] = '.';
+            }
+            label_begin = dot + 1;
+        }
+        return std::string_view(name_.data(), size);
+    }
+private:
+    static constexpr size_t kCacheSize = 128;
+
+    struct CacheEntry {
+        uint8_t input_size = 0;
+        uint8_t output_size = 0;
+        std::array<char, kMaxLabelSize> input;
+        std::array<char, kMaxLabelSize> output;
+    };
+
+    static bool IsNonAscii(char c) noexcept {
+        return static_cast<unsigned char>(c) >= 0x80;
+    }
+
+    static char LowerAscii(char c) noexcept {
+        return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+    }
+
+    // пуникод метки с символами вне ASCII
+    std::string_view ConvertLabel(std::string_view label) noexcept {
+        if (label.size() > kMaxLabelSize) {
+            return label;
+        }
+
+        CacheEntry& entry = cache_[std::hash<std::string_view>{}(label) % kCacheSize];
+        if (std::string_view(entry.input.data(), entry.input_size) == label) {
+            return std::string_view(entry.output.data(), entry.output_size);
+        }
+        std::array<char32_t, kMaxLabelSize> code_points;
+        size_t count = 0;
+        if (!DecodeUtf8(label, code_points, count)) {
+            return label;
+        }
+        const std::optional<size_t> size = EncodePunycode(std::span(code_points).first(count), entry.output);
+        if (!size) {
+            return label;
+        }
+        entry.input_size = static_cast<uint8_t>(label.size());
+        entry.output_size = static_cast<uint8_t>(*size);
+        std::copy(label.begin(), label.end(), entry.input.begin());
+        return std::string_view(entry.output.data(), entry.output_size);
+    }
+
+    // кодовые точки label, приведённые к нижнему регистру; false для некорректного UTF-8
+    static bool DecodeUtf8(std::string_view label, std::span<char32_t> code_points, size_t& count) noexcept {
+        count = 0;
+        for (size_t i = 0; i < label.size();) {
+            const unsigned char lead = static_cast<unsigned char>(label[i]);
+            const size_t length = lead < 0x80 ? 1 : (lead >> 5) == 0x6 ? 2 : (lead >> 4) == 0xE ? 3 : (lead >> 3) == 0x1E ? 4 : 0;
+            if (length == 0 || i + length > label.size() || count == code_points.size()) {
+                return false;
+            }
+            char32_t code_point = length == 1 ? lead : lead & (0x7F >> length);
+            for (size_t j = 1; j < length; ++j) {
+                const unsigned char next = static_cast<unsigned char>(label[i + j]);
+                if ((next & 0xC0) != 0x80) {
+                    return false;
+                }
+                code_point = code_point << 6 | (next & 0x3F);
+            }
+            static constexpr char32_t kMinCodePoint[] = {0, 0, 0x80, 0x800, 0x10000};
+            if (code_point < kMinCodePoint[length] || code_point > 0x10FFFF || (code_point >= 0xD800 && code_point <= 0xDFFF)) {
+                return false;
+            }
+            code_points[count++] = ToLower(code_point);
+            i += length;
+        }
+        return true;
+    }
+
+    static char32_t ToLower(char32_t c) noexcept {
+        if ((c >= U'A' && c <= U'Z') || (c >= 0xC0 && c <= 0xDE && c != 0xD7) || (c >= 0x391 && c <= 0x3A9 && c != 0x3A2) ||
+            (c >= 0x410 && c <= 0x42F)) {
+            return c + 0x20;
+        }
+        if (c >= 0x400 && c <= 0x40F) {
+            return c + 0x50;
+        }
+        return c;
+    }
+
+    // RFC 3492 с префиксом "xn--"; std::nullopt, если результат не помещается в output
+    static std::optional<size_t> EncodePunycode(std::span<const char32_t> code_points, std::span<char> output) noexcept {
+        static constexpr uint32_t kBase = 36, kTMin = 1, kTMax = 26, kSkew = 38, kDamp = 700;
+        size_t size = 0;
+        auto put = [&](char c) {
+            if (size < output.size()) {
+                output[size] = c;
+            }
+            ++size;
+        };
+        auto digit = [](uint32_t d) {
+            return static_cast<char>(d < 26 ? 'a' + d : '0' + d - 26);
+        };
+        auto adapt = [](uint32_t delta, uint32_t points, bool first) {
+            delta = first ? delta / kDamp : delta / 2;
+            delta += delta / points;
+            uint32_t k = 0;
+            while (delta > ((kBase - kTMin) * kTMax) / 2) {
+                delta /= kBase - kTMin;
+                k += kBase;
+            }
+            return k + (kBase - kTMin + 1) * delta / (delta + kSkew);
+        };
+
+        for (char c : "xn--"sv) {
+            put(c);
+        }
+        uint32_t basic = 0;
+        for (char32_t c : code_points) {
+            if (c < 0x80) {
+                put(static_cast<char>(c));
+                ++basic;
+            }
+        }
+        if (basic > 0) {
+            put('-');
+        }
+        uint32_t n = 0x80, delta = 0, bias = 72;
+        for (uint32_t handled = basic; handled < code_points.size(); ++delta, ++n) {
+            char32_t next = 0x10FFFF;
+            for (char32_t c : code_points) {
+                if (c >= n && c < next) {
+                    next = c;
+                }
+            }
+            delta += (next - n) * (handled + 1);
+            n = next;
+            for (char32_t c : code_points) {
+                if (c < n) {
+                    ++delta;
+                } else if (c == n) {
+                    uint32_t q = delta;
+                    for (uint32_t k = kBase;; k += kBase) {
+                        const uint32_t t = k <= bias ? kTMin : k >= bias + kTMax ? kTMax : k - bias;
+                        if (q < t) {
+                            break;
+                        }
+                        put(digit(t + (q - t) % (kBase - t)));
+                        q = (q - t) / (kBase - t);
+                    }
+                    put(digit(q));
+                    bias = adapt(delta, handled + 1, handled == basic);
+                    delta = 0;
+                    ++handled;
+                }
+            }
+        }
+        if (size > output.size()) {
+            return std::nullopt;
+        }
+        return size;
+    }
+
+    std::array<char, kMaxNameSize> name_;
+    // перевод имён, не помещающихся в name_
+    std::string long_name_;
+    std::array<CacheEntry, kCacheSize> cache_;
+};
+
+// Список публичных суффиксов (Public Suffix List) и регистрируемые домены (eTLD+1). Правила хранятся
+// так же, как в DomainChecker, - упорядоченными с конца имени, - по массиву на каждый вид правил:
+// обычные ("co.uk"), подстановочные ("*.kobe.jp" хранится как "kobe.jp") и исключения ("!city.kobe.jp"
+// хранится как "city.kobe.jp"). Запрос разбирается одним проходом по меткам справа налево, на каждой
+// метке - по бинарному поиску в массиве; проход останавливается, как только ни в одном массиве не
+// осталось правил глубже текущего суффикса. Результат - подстрока запроса, память не выделяется
+class PublicSuffixList {
+public:
+    // rules - строки в формате publicsuffix.org; пустые строки и комментарии "//" пропускаются
+    template <typename InputIter>
+    PublicSuffixList(InputIter begin, InputIter end) {
+        IdnaConverter converter;
+        for (; begin != end; ++begin) {
+            std::string_view rule = *begin;
+            rule = rule.substr(0, rule.find_first_of(" \t\r"sv));
+            if (rule.empty() || rule.starts_with("//"sv)) {
+                continue;
+            }
+            // в списке есть и юникодные правила, а запросы приходят уже в пуникоде
+            if (rule.starts_with('!')) {
+                exceptions_.emplace_back(converter.ToAscii(rule.substr(1)));
+            } else if (rule.starts_with("*."sv)) {
+                wildcards_.emplace_back(converter.ToAscii(rule.substr(2)));
+            } else if (rule.find('*') == std::string_view::npos) {
+                suffixes_.emplace_back(converter.ToAscii(rule));
+            } else {
+                throw std::invalid_argument("unsupported public suffix rule: "s + std::string(rule));
+            }
+        }
+        for (std::vector<Domain>* rules : {&suffixes_, &wildcards_, &exceptions_}) {
+            std::sort(rules->begin(), rules->end());
+            rules->erase(std::unique(rules->begin(), rules->end()), rules->end());
+        }
+    }
+
+    // публичный суффикс имени; по умолчанию (правило "*") - метка верхнего уровня
+    std::string_view PublicSuffix(std::string_view name) const noexcept {
+        return name.substr(PublicSuffixStart(name));
+    }
+
+    // публичный суффикс и ещё одна метка; пусто, если имя само публичный суффикс
+    std::string_view RegistrableDomain(std::string_view name) const noexcept {
+        const size_t suffix_start = PublicSuffixStart(name);
+        if (suffix_start < 2) {
+            return {};
+        }
+        const size_t dot = name.rfind('.', suffix_start - 2);
+        return name.substr(dot == std::string_view::npos ? 0 : dot + 1);
+    }
+
+    // регистрируемые домены сразу для пачки запросов, например вместе с DomainChecker::IsForbiddenBatch
+    // над той же пачкой; results[i] ссылается на имя queries[i]
+    void RegistrableDomainBatch(std::span<const Domain> queries, std::span<std::string_view> results) const noexcept {
+        assert(queries.size() == results.size());
+        for (size_t i = 0; i < queries.size(); ++i) {
+            results[i] = RegistrableDomain(queries[i].Name());
+        }
+    }
+
+    size_t RuleCount() const noexcept {
+        return suffixes_.size() + wildcards_.size() + exceptions_.size();
+    }
+private:
+    struct Probe {
+        // суффикс сам есть в массиве
+        bool found = false;
+        // в массиве есть правила для его поддоменов
+        bool deeper = false;
+    };
+
+    // поддомены suffix в порядке Domain::Less идут сразу за ним, поэтому одного lower_bound хватает на оба вопроса
+    static Probe Find(const std::vector<Domain>& rules, std::string_view suffix) noexcept {
+        auto it = std::lower_bound(rules.begin(), rules.end(), suffix, [](const Domain& rule, std::string_view value) {
+            return Domain::Less(rule.Name(), value);
+        });
+        Probe probe;
+        if (it != rules.end() && it->Name() == suffix) {
+            probe.found = true;
+            ++it;
+        }
+        probe.deeper = it != rules.end() && Domain::IsSubdomainOf(it->Name(), suffix);
+        return probe;
+    }
+
+    // позиция начала публичного суффикса в name
+    size_t PublicSuffixStart(std::string_view name) const noexcept {
+        size_t suffix_start = name.rfind('.');
+        suffix_start = suffix_start == std::string_view::npos ? 0 : suffix_start + 1;
+        size_t label_start = suffix_start;
+        // начало суффикса на одну метку короче текущего
+        size_t parent_start = name.size();
+        bool wildcard_below = false;
+        while (true) {
+            const std::string_view suffix = name.substr(label_start);
+            const Probe exception = Find(exceptions_, suffix);
+            if (exception.found) {
+                // исключение важнее всех правил: публичный суффикс - его родитель
+                return parent_start;
+            }
+            const Probe normal = Find(suffixes_, suffix);
+            if (normal.found || wildcard_below) {
+                suffix_start = label_start;
+            }
+            const Probe wildcard = Find(wildcards_, suffix);
+            wildcard_below = wildcard.found;
+            if (label_start == 0 || !(exception.deeper || normal.deeper || wildcard.found || wildcard.deeper)) {
+                return suffix_start;
+            }
+            parent_start = label_start;
+            const size_t dot = label_start >= 2 ? name.rfind('.', label_start - 2) : std::string_view::npos;
+            label_start = dot == std::string_view::npos ? 0 : dot + 1;
+        }
+    }
+
+    std::vector<Domain> suffixes_;
+    std::vector<Domain> wildcards_;
+    std::vector<Domain> exceptions_;
+};
+
+// Читаем number доменов из потока input
+std::vector<Domain> ReadDomains(std::istream& input, const size_t number) {
+    DOMAIN_FILTER_PHASE("read"sv);
+    std::vector<Domain> domains;
+    domains.reserve(number);
+    if(!number) {
+        return domains;
+    }
+    IdnaConverter converter;
+    std::string domain_name;
+    for(size_t i = 0; i < number; ++i) {
+        getline(input, domain_name);
+        domains.emplace_back(converter.ToAscii(domain_name));
+    }
+    return domains;
+}
+
+template <typename Number>
+Number ReadNumberOnLine(std::istream& input) {
+    std::string line;
+    getline(input, line);
+
+    Number num;
+    std::istringstream(line) >> num;
+
+    return num;
+}
+
+// Сжатый список доменов для рассылки на узлы. Домены идут в порядке Domain::operator< без покрытых
+// доменов, поэтому соседние имена обычно делят длинный общий конец - общее начало перевёрнутых имён.
+// Каждое имя хранится как длина общего с предыдущим конца и своё отличающееся начало (front coding
+// по перевёрнутым именам). Имена собраны в блоки по kBlockSize, первое имя блока записано целиком,
+// так что блоки разбираются независимо, а порча одного блока не тянется в следующие.
+// Формат: kMagic, затем блоки "число имён, размер данных, данные", затем 0 и общее число имён.
+// Все числа - LEB128
+class CompressedListWriter {
+public:
+    static constexpr std::string_view kMagic = "DFLIST1\n"sv;
+    static constexpr size_t kBlockSize = 64;
+
+    explicit CompressedListWriter(std::ostream& output) : output_(output) {
+        output_.write(kMagic.data(), static_cast<std::streamsize>(kMagic.size()));
+    }
+
+    // домены должны идти в порядке Domain::operator<
+    void Add(const Domain& domain) {
+        const std::string_view name = domain.Name();
+        size_t shared = 0;
+        if (block_count_ != 0) {
+            const size_t limit = std::min(name.size(), previous_.size());
+            while (shared < limit && name[name.size() - 1 - shared] == previous_[previous_.size() - 1 - shared]) {
+                ++shared;
+            }
+        }
+        AppendVarint(block_, shared);
+        AppendVarint(block_, name.size() - shared);
+        block_.append(name.substr(0, name.size() - shared));
+        previous_.assign(name);
+        ++count_;
+        if (++block_count_ == kBlockSize) {
+            FlushBlock();
+        }
+    }
+
+    // дописывает последний блок и окончание; возвращает число имён
+    size_t Finish() {
+        FlushBlock();
+        std::string tail;
+        AppendVarint(tail, 0);
+        AppendVarint(tail, count_);
+        output_.write(tail.data(), static_cast<std::streamsize>(tail.size()));
+        output_.flush();
+        if (!output_) {
+            throw std::runtime_error("cannot write domain list");
+        }
+        return count_;
+    }
+private:
+    void FlushBlock() {
+        if (block_count_ == 0) {
+            return;
+        }
+        std::string header;
+        AppendVarint(header, block_count_);
+        AppendVarint(header, block_.size());
+        output_.write(header.data(), static_cast<std::streamsize>(header.size()));
+        output_.write(block_.data(), static_cast<std::streamsize>(block_.size()));
+        block_.clear();
+        block_count_ = 0;
+    }
+
+    std::ostream& output_;
+    std::string block_;
+    std::string previous_;
+    size_t block_count_ = 0;
+    size_t count_ = 0;
+};
+
+inline bool IsCompressedList(std::string_view data) noexcept {
+    return data.starts_with(CompressedListWriter::kMagic);
+}
+
+// Разбирает сжатый список целиком из памяти
+inline std::vector<Domain> ReadCompressedList(std::string_view data) {
+    DOMAIN_FILTER_PHASE("read"sv);
+    auto corrupted = [] {
+        return std::runtime_error("corrupted domain list");
+    };
+    auto read_number = [&](std::string_view& from) {
+        const std::optional<uint64_t> value = ReadVarint(from);
+        if (!value) {
+            throw corrupted();
+        }
+        return *value;
+    };
+    if (!IsCompressedList(data)) {
+        throw corrupted();
+    }
+    data.remove_prefix(CompressedListWriter::kMagic.size());
+
+    std::vector<Domain> domains;
+    std::string name;
+    std::string previous;
+    while (const uint64_t block_count = read_number(data)) {
+        const uint64_t block_size = read_number(data);
+        if (block_size > data.size()) {
+            throw corrupted();
+        }
+        std::string_view block = data.substr(0, block_size);
+        data.remove_prefix(block_size);
+        for (uint64_t i = 0; i < block_count; ++i) {
+            const uint64_t shared = read_number(block);
+            const uint64_t own = read_number(block);
+            if ((i == 0 && shared != 0) || shared > previous.size() || own > block.size()) {
+                throw corrupted();
+            }
+            name.assign(block.substr(0, own));
+            name.append(previous, previous.size() - shared);
+            block.remove_prefix(own);
+            domains.emplace_back(name);
+            std::swap(name, previous);
+        }
+        if (!block.empty()) {
+            throw corrupted();
+        }
+    }
+    if (read_number(data) != domains.size() || !data.empty()) {
+        throw corrupted();
+    }
+    return domains;
+}
+
+// Кодирует результаты проверки запросов в одном из форматов вывода:
+// kText    - строка "Bad" или "Good" на каждый запрос;
+// kBitmap  - по биту на запрос в порядке ввода, младший бит байта - первый запрос, последний байт
+//            дополняется нулями;
+// kIndices - номера запрещённых запросов, каждый записан как LEB128-разность с номером,
+//            следующим за предыдущим запрещённым (первый - разность с нулём)
+class VerdictEncoder {
+public:
+    enum class Format {
+        kText,
+        kBitmap,
+        kIndices,
+    };
+
+    explicit VerdictEncoder(Format format) : format_(format) {
+    }
+
+    void Add(bool forbidden, std::string& out) {
+        switch (format_) {
+        case Format::kText:
+            out += forbidden ? "Bad\n"sv : "Good\n"sv;
+            break;
+        case Format::kBitmap:
+            bits_ |= static_cast<unsigned char>(forbidden) << (index_ % 8);
+            if (index_ % 8 == 7) {
+                out += static_cast<char>(bits_);
+                bits_ = 0;
+            }
+            break;
+        case Format::kIndices:
+            if (forbidden) {
+                AppendVarint(out, index_ - next_index_);
+                next_index_ = index_ + 1;
+            }
+            break;
+        }
+        ++index_;
+    }
+
+    // дописывает неполный последний байт битовой карты
+    void Finish(std::string& out) {
+        if (format_ == Format::kBitmap && index_ % 8 != 0) {
+            out += static_cast<char>(bits_);
+            bits_ = 0;
+        }
+    }
+private:
+    Format format_;
+    size_t index_ = 0;
+    size_t next_index_ = 0;
+    unsigned char bits_ = 0;
+};
+
+// Когда проверять пачку соединением слиянием (DomainChecker::IsForbiddenJoin)
+enum class JoinPolicy {
+    // если запросов не меньше десятой доли правил: при меньшей доле последовательный проход
+    // по правилам перестаёт окупаться
+    kAuto,
+    kAlways,
+    kNever,
+};
+
+template <typename Checker>
+concept JoinableChecker = requires(const Checker& checker, std::span<const Domain> domains, std::span<bool> verdicts) {
+    checker.IsForbiddenJoin(domains, verdicts);
+};
+
+template <typename Checker>
+bool UseJoin(const Checker& checker, size_t queries_count, JoinPolicy policy) {
+    if constexpr (JoinableChecker<Checker>) {
+        return policy == JoinPolicy::kAlways ||
+               (policy == JoinPolicy::kAuto && queries_count >= 4096 && queries_count * 10 >= checker.RuleCount());
+    } else {
+        return false;
+    }
+}
+
+// Проверяет пачку соединением слиянием или бинарными поисками, смотря по join
+template <typename Checker>
+void CheckQueries(const Checker& checker, std::span<const Domain> domains, std::span<bool> verdicts, JoinPolicy join) {
+    if constexpr (JoinableChecker<Checker>) {
+        if (UseJoin(checker, domains.size(), join)) {
+            checker.IsForbiddenJoin(domains, verdicts);
+            return;
+        }
+    }
+    checker.IsForbiddenBatch(domains, verdicts);
+}
+
+// Оценивает по выборке, много ли среди запросов повторов: берутся kSamples окон по kWindow подряд
+// идущих запросов, чтобы заметить и серии одинаковых строк, и повторы вразброс
+inline bool HasManyDuplicates(std::span<const Domain> domains) {
+    static constexpr size_t kSamples = 64;
+    static constexpr size_t kWindow = 64;
+    // доля повторов, начиная с которой хэширование дешевле лишних поисков
+    static constexpr double kMinDuplicateRatio = 0.5;
+    if (domains.size() < kSamples * kWindow) {
+        return false;
+    }
+    std::unordered_set<std::string_view> distinct;
+    const size_t stride = domains.size() / kSamples;
+    for (size_t sample = 0; sample < kSamples; ++sample) {
+        for (size_t i = sample * stride; i < sample * stride + kWindow; ++i) {
+            distinct.insert(domains[i].Name());
+        }
+    }
+    return 1.0 - static_cast<double>(distinct.size()) / (kSamples * kWindow) >= kMinDuplicateRatio;
+}
+
+// Проверяет каждое различное имя один раз и раскладывает ответы по местам запросов.
+// Подряд идущие одинаковые имена узнаются без хэширования
+template <typename Checker>
+void CheckDistinctQueries(const Checker& checker, std::span<const Domain> domains, std::span<bool> verdicts,
+                          JoinPolicy join = JoinPolicy::kAuto) {
+    DOMAIN_FILTER_PHASE("dedup"sv);
+    // вызов один на всю пачку, поэтому замеряется всегда; проверки различных имён замеряются и сами
+    DOMAIN_FILTER_RECORD(BatchLookups, domains.size());
+    assert(domains.size() == verdicts.size());
+    std::vector<uint32_t> distinct_index(domains.size());
+    std::vector<Domain> distinct;
+    std::unordered_map<std::string_view, uint32_t> index_by_name;
+    for (size_t i = 0; i < domains.size(); ++i) {
+        if (i != 0 && domains[i] == domains[i - 1]) {
+            distinct_index[i] = distinct_index[i - 1];
+            continue;
+        }
+        const auto [it, inserted] = index_by_name.try_emplace(domains[i].Name(), static_cast<uint32_t>(distinct.size()));
+        if (inserted) {
+            distinct.push_back(domains[i]);
+        }
+        distinct_index[i] = it->second;
+    }
+
+    std::unique_ptr<bool[]> distinct_verdicts(new bool[distinct.size()]);
+    CheckQueries(checker, distinct, std::span(distinct_verdicts.get(), distinct.size()), join);
+    for (size_t i = 0; i < domains.size(); ++i) {
+        verdicts[i] = distinct_verdicts[distinct_index[i]];
+    }
+}
+
+// Проверяет запросы и выводит результаты в формате format, накапливая вывод в буфере.
+// Если запросы часто повторяются, сначала проверяются различные имена (см. CheckDistinctQueries),
+// большие пачки проверяются соединением слиянием согласно join
+template <typename Checker>
+void WriteVerdicts(const Checker& checker, const std::vector<Domain>& domains,
+                   VerdictEncoder::Format format, std::ostream& output, JoinPolicy join = JoinPolicy::kAuto) {
+    static constexpr size_t kFlushSize = 64 * 1024;
+    DOMAIN_FILTER_PHASE("check"sv);
+
+    std::unique_ptr<bool[]> all_verdicts;
+    if (HasManyDuplicates(domains)) {
+        all_verdicts.reset(new bool[domains.size()]);
+        CheckDistinctQueries(checker, domains, std::span(all_verdicts.get(), domains.size()), join);
+    } else if (UseJoin(checker, domains.size(), join)) {
+        all_verdicts.reset(new bool[domains.size()]);
+        CheckQueries(checker, domains, std::span(all_verdicts.get(), domains.size()), join);
+    }
+
+    VerdictEncoder encoder(format);
+    std::string text;
+    std::array<bool, 4 * DomainChecker::kBatchSize> verdicts;
+    for (size_t first = 0; first < domains.size(); first += verdicts.size()) {
+        const size_t count = std::min(verdicts.size(), domains.size() - first);
+        if (all_verdicts) {
+            std::copy_n(all_verdicts.get() + first, count, verdicts.begin());
+        } else {
+            checker.IsForbiddenBatch(std::span(domains).subspan(first, count), std::span(verdicts).first(count));
+        }
+        for (size_t i = 0; i < count; ++i) {
+            encoder.Add(verdicts[i], text);
+        }
+        if (text.size() >= kFlushSize) {
+            output.write(text.data(), static_cast<std::streamsize>(text.size()));
+            text.clear();
+        }
+    }
+    encoder.Finish(text);
+    output.write(text.data(), static_cast<std::streamsize>(text.size()));
+    output.flush();
+}
+
+// Выводит на каждый запрос "Bad" или "Good" и через пробел его регистрируемый домен ("-", если его нет).
+// Обе проверки идут по одной пачке запросов, пока её имена ещё в кэше
+template <typename Checker>
+void WriteVerdictsWithRegistrable(const Checker& checker, const PublicSuffixList& public_suffixes,
+                                  const std::vector<Domain>& domains, std::ostream& output) {
+    static constexpr size_t kFlushSize = 64 * 1024;
+    DOMAIN_FILTER_PHASE("check"sv);
+
+    std::string text;
+    std::array<bool, 4 * DomainChecker::kBatchSize> verdicts;
+    std::array<std::string_view, verdicts.size()> registrable;
+    for (size_t first = 0; first < domains.size(); first += verdicts.size()) {
+        const size_t count = std::min(verdicts.size(), domains.size() - first);
+        const std::span<const Domain> batch = std::span(domains).subspan(first, count);
+        checker.IsForbiddenBatch(batch, std::span(verdicts).first(count));
+        public_suffixes.RegistrableDomainBatch(batch, std::span(registrable).first(count));
+        for (size_t i = 0; i < count; ++i) {
+            text += verdicts[i] ? "Bad "sv : "Good "sv;
+            text += registrable[i].empty() ? "-"sv : registrable[i];
+            text += '\n';
+        }
+        if (text.size() >= kFlushSize) {
+            output.write(text.data(), static_cast<std::streamsize>(text.size()));
+            text.clear();
+        }
+    }
+    output.write(text.data(), static_cast<std::streamsize>(text.size()));
+    output.flush();
+}
+
+// ********************************** Конвейер *****************************************************
+// Ограниченная очередь между стадиями конвейера: Push ждёт свободного места, Pop - данных.
+// После Close очередь отдаёт оставшиеся элементы, а затем std::nullopt
+template <typename Value>
+class StageQueue {
+public:
+    explicit StageQueue(size_t capacity) : capacity_(capacity) {
+    }
+
+    void Push(Value value) {
+        std::unique_lock lock(mutex_);
+        not_full_.wait(lock, [this] { return values_.size() < capacity_; });
+        values_.push_back(std::move(value));
+        not_empty_.notify_one();
+    }
+
+    std::optional<Value> Pop() {
+        std::unique_lock lock(mutex_);
+        not_empty_.wait(lock, [this] { return !values_.empty() || closed_; });
+        if (values_.empty()) {
+            return std::nullopt;
+        }
+        Value value = std::move(values_.front());
+        values_.pop_front();
+        not_full_.notify_one();
+        return value;
+    }
+
+    void Close() {
+        std::lock_guard lock(mutex_);
+        closed_ = true;
+        not_empty_.notify_all();
+    }
+private:
+    const size_t capacity_;
+    std::deque<Value> values_;
+    bool closed_ = false;
+    std::mutex mutex_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+};
+
+// Проверяет number доменов из input и пишет результаты в output, совмещая ввод, проверку и вывод:
+// поток чтения забирает из input всё, что уже пришло (до блока целиком), текущий поток разбирает
+// строки и проверяет их, поток записи выводит готовые ответы. Блоки ввода и буферы вывода
+// переиспользуются по кругу, поэтому каждая стадия работает со своим буфером, пока соседние заняты
+// другими. Блок не ждёт заполнения, поэтому на потоковом входе ответы выходят по мере прихода строк;
+// для этого у std::cin должна быть отключена синхронизация с stdio (см. RunMode)
+void CheckDomainsPipelined(const DomainChecker& checker, std::istream& input, size_t number,
+                           std::ostream& output, VerdictEncoder::Format format = VerdictEncoder::Format::kText) {
+    static constexpr size_t kBlockSize = 1 << 20;
+    static constexpr size_t kBuffersCount = 3;
+
+    StageQueue<std::string> free_blocks(kBuffersCount);
+    StageQueue<std::string> filled_blocks(kBuffersCount);
+    StageQueue<std::string> free_outputs(kBuffersCount);
+    StageQueue<std::string> ready_outputs(kBuffersCount);
+    for (size_t i = 0; i < kBuffersCount; ++i) {
+        free_blocks.Push(std::string(kBlockSize, '\0'));
+        free_outputs.Push(std::string{});
+    }
+
+    std::atomic<bool> stop_reading = false;
+    std::thread reader([&] {
+        while (!stop_reading) {
+            std::optional<std::string> block = free_blocks.Pop();
+            if (!block) {
+                break;
+            }
+            block->resize(kBlockSize);
+            // readsome отдаёт только уже прочитанные и доступные без ожидания байты;
+            // если их нет, peek ждёт, пока придёт хоть что-нибудь
+            std::streamsize size = input.readsome(block->data(), static_cast<std::streamsize>(block->size()));
+            if (size == 0 && input.peek() != std::char_traits<char>::eof()) {
+                size = input.readsome(block->data(), static_cast<std::streamsize>(block->size()));
+            }
+            if (size <= 0) {
+                break;
+            }
+            block->resize(static_cast<size_t>(size));
+            filled_blocks.Push(std::move(*block));
+        }
+        filled_blocks.Close();
+    });
+    std::thread writer([&] {
+        while (std::optional<std::string> text = ready_outputs.Pop()) {
+            output.write(text->data(), static_cast<std::streamsize>(text->size()));
+            output.flush();
+            text->clear();
+            free_outputs.Push(std::move(*text));
+        }
+    });
+
+    size_t checked = 0;
+    std::string carry;
+    VerdictEncoder encoder(format);
+    IdnaConverter converter;
+    auto check_line = [&](std::string_view line, std::string& text) {
+        encoder.Add(checker.IsForbidden(converter.ToAscii(line)), text);
+        ++checked;
+    };
+    while (checked < number) {
+        std::optional<std::string> block = filled_blocks.Pop();
+        std::string text = *free_outputs.Pop();
+        if (!block) {
+            // как и ReadDomains, недостающие строки считаются пустыми доменами
+            if (!carry.empty()) {
+                check_line(carry, text);
+                carry.clear();
+            }
+            while (checked < number) {
+                check_line(""sv, text);
+            }
+            encoder.Finish(text);
+            ready_outputs.Push(std::move(text));
+            break;
+        }
+
+        std::string_view data = *block;
+        for (size_t line_end = data.find('\n'); line_end != std::string_view::npos && checked < number;
+             line_end = data.find('\n')) {
+            if (carry.empty()) {
+                check_line(data.substr(0, line_end), text);
+            } else {
+                carry.append(data.substr(0, line_end));
+                check_line(carry, text);
+                carry.clear();
+            }
+            data.remove_prefix(line_end + 1);
+        }
+        if (checked < number) {
+            carry.append(data);
+        } else {
+            encoder.Finish(text);
+        }
+        free_blocks.Push(std::move(*block));
+        ready_outputs.Push(std::move(text));
+    }
+
+    stop_reading = true;
+    // освобождаем поток чтения, если он ждёт свободный блок или места в очереди
+    free_blocks.Close();
+    while (filled_blocks.Pop()) {
+    }
+    reader.join();
+    ready_outputs.Close();
+    writer.join();
+}
+
+// ********************************** Параллельная обработка ***************************************
+// Весь вход в памяти, разбитый на строки параллельно по частям
+class InputLines {
+public:
+    InputLines(std::string text, WorkStealingPool& pool) : text_(std::move(text)) {
+        static constexpr size_t kChunkSize = 1 << 20;
+        const size_t chunks_count = (text_.size() + kChunkSize - 1) / kChunkSize;
+        std::vector<std::vector<size_t>> chunk_line_ends(chunks_count);
+        pool.ParallelFor(0, chunks_count, 1, [&](size_t first, size_t last) {
+            for (size_t chunk = first; chunk < last; ++chunk) {
+                const size_t end = std::min(text_.size(), (chunk + 1) * kChunkSize);
+                for (size_t position = chunk * kChunkSize; position < end; ++position) {
+                    if (text_[position] == '\n') {
+                        chunk_line_ends[chunk].push_back(position);
+                    }
+                }
+            }
+        });
+        for (const std::vector<size_t>& ends : chunk_line_ends) {
+            line_ends_.insert(line_ends_.end(), ends.begin(), ends.end());
+        }
+        if (!text_.empty() && text_.back() != '\n') {
+            line_ends_.push_back(text_.size());
+        }
+    }
+
+    size_t Count() const noexcept {
+        return line_ends_.size();
+    }
+
+    // как и getline в ReadDomains, за концом входа возвращает пустые строки
+    std::string_view Line(size_t index) const noexcept {
+        if (index >= line_ends_.size()) {
+            return {};
+        }
+        const size_t begin = index == 0 ? 0 : line_ends_[index - 1] + 1;
+        return std::string_view(text_).substr(begin, line_ends_[index] - begin);
+    }
+
+    // домены из строк [first, first + count), созданные по частям в задачах пула
+    std::vector<Domain> Domains(size_t first, size_t count, WorkStealingPool& pool) const {
+        static constexpr size_t kChunkSize = 64 * 1024;
+        const size_t chunks_count = (count + kChunkSize - 1) / kChunkSize;
+        std::vector<std::vector<Domain>> chunks(chunks_count);
+        pool.ParallelFor(0, chunks_count, 1, [&](size_t first_chunk, size_t last_chunk) {
+            for (size_t chunk = first_chunk; chunk < last_chunk; ++chunk) {
+                const size_t end = std::min(count, (chunk + 1) * kChunkSize);
+                chunks[chunk].reserve(end - chunk * kChunkSize);
+                IdnaConverter converter;
+                for (size_t i = chunk * kChunkSize; i < end; ++i) {
+                    chunks[chunk].emplace_back(converter.ToAscii(Line(first + i)));
+                }
+            }
+        });
+
+        std::vector<Domain> domains;
+        domains.reserve(count);
+        for (std::vector<Domain>& chunk : chunks) {
+            std::move(chunk.begin(), chunk.end(), std::back_inserter(domains));
+        }
+        return domains;
+    }
+private:
+    std::string text_;
+    std::vector<size_t> line_ends_;
+};
+
+// Параллельный вариант основного режима: чтение входа целиком, разбор строк по частям, параллельное
+// построение индекса и проверка запросов частями с выводом частей строго в порядке ввода.
+// Если checker задан (список пришёл из --forbidden), вход содержит только запросы
+void CheckDomainsParallel(std::istream& input, std::ostream& output, VerdictEncoder::Format format,
+                          WorkStealingPool& pool, const DomainChecker* checker = nullptr) {
+    // кратен 8, чтобы части битовой карты начинались с границы байта
+    static constexpr size_t kChunkSize = 16 * 1024;
+
+    const InputLines lines(std::string(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>()), pool);
+    auto parse_count = [&lines](size_t index) {
+        std::istringstream line{std::string(lines.Line(index))};
+        size_t count = 0;
+        line >> count;
+        return count;
+    };
+    size_t queries_line = 0;
+    std::optional<DomainChecker> input_checker;
+    if (checker == nullptr) {
+        const size_t forbidden_count = parse_count(0);
+        checker = &input_checker.emplace(lines.Domains(1, forbidden_count, pool), pool);
+        queries_line = forbidden_count + 1;
+    }
+    const size_t queries_count = parse_count(queries_line);
+    const std::vector<Domain> queries = lines.Domains(queries_line + 1, queries_count, pool);
+
+    const size_t chunks_count = (queries.size() + kChunkSize - 1) / kChunkSize;
+    std::unique_ptr<bool[]> verdicts(new bool[queries.size()]);
+    std::vector<std::string> texts(chunks_count);
+    pool.ParallelFor(0, chunks_count, 1, [&](size_t first, size_t last) {
+        for (size_t chunk = first; chunk < last; ++chunk) {
+            const size_t begin = chunk * kChunkSize;
+            const size_t count = std::min(kChunkSize, queries.size() - begin);
+            checker->IsForbiddenBatch(std::span(queries).subspan(begin, count), std::span(verdicts.get() + begin, count));
+            // номера запрещённых запросов кодируются разностями через границы частей, их кодирует вывод
+            if (format != VerdictEncoder::Format::kIndices) {
+                VerdictEncoder encoder(format);
+                for (size_t i = begin; i < begin + count; ++i) {
+                    encoder.Add(verdicts[i], texts[chunk]);
+                }
+                encoder.Finish(texts[chunk]);
+            }
+        }
+    });
+
+    if (format == VerdictEncoder::Format::kIndices) {
+        VerdictEncoder encoder(format);
+        std::string text;
+        for (size_t i = 0; i < queries.size(); ++i) {
+            encoder.Add(verdicts[i], text);
+        }
+        output.write(text.data(), static_cast<std::streamsize>(text.size()));
+    }
+    for (const std::string& text : texts) {
+        output.write(text.data(), static_cast<std::streamsize>(text.size()));
+    }
+    output.flush();
+}
+
+// ********************************** Внешняя сборка индекса ***************************************
+// Сборка индекса сортировкой во внешней памяти для списков, которые не помещаются в память.
+// Индекс - сжатый список (см. CompressedListWriter) правил без покрытых доменов.
+// Домены копятся в памяти, пока не наберётся половина memory_limit (вторая половина - запас на рост
+// вектора и сортировку), затем сортируются, очищаются от покрытых доменов и сбрасываются во временный
+// прогон рядом с индексом. Finish сливает прогоны, убирая покрытые домены и на стыках прогонов:
+// поддомены в порядке Domain::operator< идут сразу за своим родителем, поэтому достаточно сравнивать
+// домен с последним оставленным. Если прогонов больше, чем позволяет память под буферы чтения,
+// они сливаются в несколько проходов
+class ExternalIndexBuilder {
+public:
+    // меньше буфера на прогон не берём, иначе чтение распадается на мелкие обращения к диску
+    static constexpr size_t kMinBufferSize = 64 * 1024;
+
+    ExternalIndexBuilder(std::filesystem::path index_path, size_t memory_limit)
+        : index_path_(std::move(index_path)), memory_limit_(std::max(memory_limit, 4 * kMinBufferSize)) {
+    }
+
+    ExternalIndexBuilder(const ExternalIndexBuilder&) = delete;
+    ExternalIndexBuilder& operator=(const ExternalIndexBuilder&) = delete;
+
+    ~ExternalIndexBuilder() {
+        std::error_code error;
+        for (const std::vector<std::filesystem::path>* runs : {&runs_, &merged_runs_}) {
+            for (const std::filesystem::path& run : *runs) {
+                std::filesystem::remove(run, error);
+            }
+        }
+    }
+
+    void Add(std::string_view name) {
+        const Domain& domain = buffer_.emplace_back(converter_.ToAscii(name));
+        buffered_bytes_ += sizeof(Domain) + domain.Name().size();
+        if (buffered_bytes_ >= memory_limit_ / 2) {
+            SpillRun();
+        }
+    }
+
+    // сливает прогоны в индекс и возвращает число правил в нём
+    size_t Finish() {
+        DOMAIN_FILTER_PHASE("merge"sv);
+        if (runs_.empty()) {
+            // всё поместилось в память: прогоны не нужны
+            SortAndCollapse();
+            std::ofstream index = CreateIndex();
+            CompressedListWriter writer(index);
+            for (const Domain& domain : buffer_) {
+                writer.Add(domain);
+            }
+            return writer.Finish();
+        }
+        if (!buffer_.empty()) {
+            SpillRun();
+        }
+        std::vector<Domain>().swap(buffer_);
+
+        const size_t fan_in = std::clamp<size_t>(memory_limit_ / kMinBufferSize - 1, 2, 256);
+        while (runs_.size() > fan_in) {
+            // новый прогон записывается в merged_runs_ до создания файла: если проход прервётся
+            // (например, кончится место на диске), деструктор удалит и его
+            for (size_t first = 0; first < runs_.size(); first += fan_in) {
+                const std::span<const std::filesystem::path> group =
+                    std::span(runs_).subspan(first, std::min(fan_in, runs_.size() - first));
+                merged_runs_.push_back(NextRunPath());
+                std::ofstream run(merged_runs_.back(), std::ios::binary);
+                MergeRuns(group, [&run](const Domain& domain) {
+                    run << domain.Name() << '\n';
+                });
+                if (!run.flush()) {
+                    throw std::runtime_error("cannot write "s + merged_runs_.back().string());
+                }
+                for (const std::filesystem::path& path : group) {
+                    std::filesystem::remove(path);
+                }
+            }
+            runs_ = std::exchange(merged_runs_, {});
+        }
+
+        std::ofstream index = CreateIndex();
+        CompressedListWriter writer(index);
+        MergeRuns(runs_, [&writer](const Domain& domain) {
+            writer.Add(domain);
+        });
+        return writer.Finish();
+    }
+
+    // число сброшенных на диск прогонов за всё время сборки
+    size_t SpilledRuns() const noexcept {
+        return spilled_runs_;
+    }
+private:
+    // Упорядоченный прогон на диске, читаемый по одному домену через собственный буфер
+    class RunReader {
+    public:
+        RunReader(const std::filesystem::path& path, size_t buffer_size) : buffer_(buffer_size) {
+            file_.rdbuf()->pubsetbuf(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+            file_.open(path, std::ios::binary);
+            if (!file_) {
+                throw std::runtime_error("cannot open "s + path.string());
+            }
+            Next();
+        }
+
+        bool Valid() const noexcept {
+            return current_.has_value();
+        }
+
+        const Domain& Current() const noexcept {
+            return *current_;
+        }
+
+        void Next() {
+            if (getline(file_, line_)) {
+                current_.emplace(line_);
+            } else {
+                current_.reset();
+            }
+        }
+    private:
+        std::vector<char> buffer_;
+        std::ifstream file_;
+        std::string line_;
+        std::optional<Domain> current_;
+    };
+
+    void SortAndCollapse() {
+        DOMAIN_FILTER_PHASE("sort_run"sv);
+        std::sort(buffer_.begin(), buffer_.end());
+        buffer_.erase(std::unique(buffer_.begin(), buffer_.end(), [](const Domain& lhs, const Domain& rhs) {
+            return rhs.IsSubdomain(lhs);
+        }), buffer_.end());
+    }
+
+    void SpillRun() {
+        SortAndCollapse();
+        runs_.push_back(NextRunPath());
+        std::ofstream run(runs_.back(), std::ios::binary);
+        for (const Domain& domain : buffer_) {
+            run << domain.Name() << '\n';
+        }
+        if (!run.flush()) {
+            throw std::runtime_error("cannot write "s + runs_.back().string());
+        }
+        buffer_.clear();
+        buffered_bytes_ = 0;
+        ++spilled_runs_;
+    }
+
+    std::ofstream CreateIndex() const {
+        std::ofstream index(index_path_, std::ios::binary);
+        if (!index) {
+            throw std::runtime_error("cannot create "s + index_path_.string());
+        }
+        return index;
+    }
+
+    std::filesystem::path NextRunPath() {
+        std::filesystem::path path = index_path_;
+        path += ".run"s + std::to_string(next_run_++);
+        return path;
+    }
+
+    // k-путевое слияние прогонов с выбрасыванием покрытых доменов
+    template <typename Consumer>
+    void MergeRuns(std::span<const std::filesystem::path> runs, Consumer&& consume) {
+        const size_t buffer_size = std::max(kMinBufferSize, memory_limit_ / (runs.size() + 1));
+        std::vector<std::unique_ptr<RunReader>> readers;
+        for (const std::filesystem::path& path : runs) {
+            readers.push_back(std::make_unique<RunReader>(path, buffer_size));
+        }
+        auto greater = [&readers](size_t lhs, size_t rhs) {
+            return readers[rhs]->Current() < readers[lhs]->Current();
+        };
+        std::priority_queue<size_t, std::vector<size_t>, decltype(greater)> heads(greater);
+        for (size_t i = 0; i < readers.size(); ++i) {
+            if (readers[i]->Valid()) {
+                heads.push(i);
+            }
+        }
+
+        std::optional<Domain> last_kept;
+        while (!heads.empty()) {
+            const size_t index = heads.top();
+            heads.pop();
+            const Domain& domain = readers[index]->Current();
+            if (!last_kept || !domain.IsSubdomain(*last_kept)) {
+                consume(domain);
+                last_kept = domain;
+            }
+            readers[index]->Next();
+            if (readers[index]->Valid()) {
+                heads.push(index);
+            }
+        }
+    }
+
+    std::filesystem::path index_path_;
+    size_t memory_limit_;
+    IdnaConverter converter_;
+    std::vector<Domain> buffer_;
+    size_t buffered_bytes_ = 0;
+    std::vector<std::filesystem::path> runs_;
+    // прогоны текущего прохода многопроходного слияния
+    std::vector<std::filesystem::path> merged_runs_;
+    size_t next_run_ = 0;
+    size_t spilled_runs_ = 0;
+};
+
+// ********************************** Сервер *******************************************************
+#ifdef __linux__
+// Владеет файловым дескриптором и закрывает его при разрушении
+class FileDescriptor {
+public:
+    explicit FileDescriptor(int fd) : fd_(fd) {
+        if (fd_ < 0) {
+            throw std::system_error(errno, std::generic_category(), "socket");
+        }
+    }
+
+    FileDescriptor(FileDescriptor&& other) noexcept : fd_(std::exchange(other.fd_, -1)) {
+    }
+
+    FileDescriptor(const FileDescriptor&) = delete;
+    FileDescriptor& operator=(const FileDescriptor&) = delete;
+
+    ~FileDescriptor() {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    int Get() const noexcept {
+        return fd_;
+    }
+private:
+    int fd_;
+};
+
+sockaddr_un MakeSocketAddress(std::string_view path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw std::invalid_argument("socket path is too long: "s + std::string(path));
+    }
+    path.copy(address.sun_path, path.size());
+    return address;
+}
+
+// Строка запроса длиннее этого считается ошибкой клиента: иначе строка без '\n' копилась бы без предела
+inline constexpr size_t kMaxRequestLineSize = 64 * 1024;
+
+// Состояние одного соединения сервера: недочитанная строка запросов и ещё не отправленные ответы.
+// Запросы - домены, разделённые '\n', ответы - "Bad\n"/"Good\n" в том же порядке. Клиент может слать
+// запросы не дожидаясь ответов: все полные строки прочитанного блока проверяются подряд
+class ClientConnection {
+public:
+    explicit ClientConnection(int fd) : fd_(fd) {
+    }
+
+    int Fd() const noexcept {
+        return fd_.Get();
+    }
+
+    bool HasResponses() const noexcept {
+        return sent_ < response_.size();
+    }
+
+    // Читает один блок, если он есть, и готовит ответы на его полные строки. false - клиент закрыл
+    // соединение или прислал строку длиннее kMaxRequestLineSize
+    template <typename HitCounter>
+    bool Receive(ReplicatedDomainChecker::Reader& reader, IdnaConverter& converter, HitCounter& hit_counter,
+                 QueryCache* cache) {
+        char buffer[64 * 1024];
+        const ssize_t received = read(fd_.Get(), buffer, sizeof(buffer));
+        if (received < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if (received < 0 && errno == ECONNRESET) {
+            return false;
+        }
+        if (received < 0) {
+            throw std::system_error(errno, std::generic_category(), "read");
+        }
+        if (received == 0) {
+            return false;
+        }
+        pending_.append(buffer, static_cast<size_t>(received));
+
+        // поколение кэша читается раньше копий: ответы старых копий не попадут в кэш под новым поколением
+        const uint32_t generation = cache != nullptr ? cache->Generation() : 0;
+        const DomainChecker& local_checker = reader.Current();
+        auto is_forbidden = [&](const Domain& domain) {
+            if (cache == nullptr) {
+                return local_checker.IsForbidden(domain, hit_counter);
+            }
+            return cache->GetOrCompute(domain, generation, [&] {
+                return local_checker.IsForbidden(domain, hit_counter);
+            });
+        };
+
+        size_t line_begin = 0;
+        for (size_t line_end = pending_.find('\n'); line_end != std::string::npos;
+             line_end = pending_.find('\n', line_begin)) {
+            const Domain domain(converter.ToAscii(std::string_view(pending_).substr(line_begin, line_end - line_begin)));
+            response_ += is_forbidden(domain) ? "Bad\n"sv : "Good\n"sv;
+            line_begin = line_end + 1;
+        }
+        pending_.erase(0, line_begin);
+        if (pending_.size() > kMaxRequestLineSize) {
+            std::cerr << "request line is too long, closing the connection"sv << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Отправляет столько ответов, сколько примет сокет. false - клиент закрыл соединение.
+    // MSG_NOSIGNAL не даёт записи в закрытый сокет убить процесс сигналом SIGPIPE
+    bool Send() {
+        while (HasResponses()) {
+            const ssize_t written = send(fd_.Get(), response_.data() + sent_, response_.size() - sent_, MSG_NOSIGNAL);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return true;
+                }
+                if (errno == EPIPE || errno == ECONNRESET) {
+                    return false;
+                }
+                throw std::system_error(errno, std::generic_category(), "send");
+            }
+            sent_ += static_cast<size_t>(written);
+        }
+        response_.clear();
+        sent_ = 0;
+        return true;
+    }
+private:
+    FileDescriptor fd_;
+    std::string pending_;
+    std::string response_;
+    size_t sent_ = 0;
+};
+
+// Создаёт сокет на path. Оставшийся от прошлого запуска сокет удаляется, любой другой файл - нет
+FileDescriptor ListenUnixSocket(std::string_view path) {
+    FileDescriptor listener(socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0));
+    const sockaddr_un address = MakeSocketAddress(path);
+    struct stat status{};
+    if (lstat(address.sun_path, &status) == 0) {
+        if (!S_ISSOCK(status.st_mode)) {
+            throw std::runtime_error("not a socket, refusing to replace: "s + std::string(path));
+        }
+        unlink(address.sun_path);
+    } else if (errno != ENOENT) {
+        throw std::system_error(errno, std::generic_category(), "lstat");
+    }
+    if (bind(listener.Get(), reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0) {
+        throw std::system_error(errno, std::generic_category(), "bind");
+    }
+    if (listen(listener.Get(), SOMAXCONN) < 0) {
+        throw std::system_error(errno, std::generic_category(), "listen");
+    }
+    return listener;
+}
+
+// Загружает список запрещённых доменов один раз и отвечает на запросы через unix-сокет.
+// Каждый рабочий поток ведёт свои соединения через epoll: сокеты неблокирующие, и за одно событие
+// соединение получает не больше одного блока чтения, поэтому молчащие или медленные клиенты не
+// задерживают остальных. Новые соединения потоки принимают с общего сокета (EPOLLEXCLUSIVE будит
+// один из них). Checker читается без каких-либо блокировок. Если узлов NUMA несколько, потоки
+// распределяются по узлам, привязываются к ним и читают копию своего узла. Срабатывания правил
+// учитываются в hit_counter, ответы на повторные запросы берутся из cache, если он задан
+template <typename HitCounter = NoHitCounter>
+void RunServer(std::string_view socket_path, const ReplicatedDomainChecker& checker, size_t workers_count,
+               HitCounter&& hit_counter = {}, QueryCache* cache = nullptr) {
+    const FileDescriptor listener = ListenUnixSocket(socket_path);
+
+    // первая неустранимая ошибка рабочего потока; остальные потоки продолжают работать
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    auto worker = [&](size_t node) {
+        try {
+            if (checker.Topology().NodeCount() > 1) {
+                checker.Topology().PinCurrentThread(node);
+            }
+            const FileDescriptor poller(epoll_create1(EPOLL_CLOEXEC));
+            auto watch = [&poller](int operation, int fd, uint32_t events) {
+                epoll_event event{};
+                event.events = events;
+                event.data.fd = fd;
+                if (epoll_ctl(poller.Get(), operation, fd, &event) < 0) {
+                    throw std::system_error(errno, std::generic_category(), "epoll_ctl");
+                }
+            };
+            watch(EPOLL_CTL_ADD, listener.Get(), EPOLLIN | EPOLLEXCLUSIVE);
+
+            ReplicatedDomainChecker::Reader reader(checker, node);
+            IdnaConverter converter;
+            std::unordered_map<int, ClientConnection> connections;
+            auto accept_connections = [&] {
+                for (;;) {
+                    const int fd = accept4(listener.Get(), nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if (fd >= 0) {
+                        connections.try_emplace(fd, fd);
+                        watch(EPOLL_CTL_ADD, fd, EPOLLIN);
+                        continue;
+                    }
+                    if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO) {
+                        continue;
+                    }
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        return;
+                    }
+                    if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                        // нехватка ресурсов проходит, когда закроются другие соединения
+                        std::cerr << std::system_error(errno, std::generic_category(), "accept").what() << std::endl;
+                        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                        return;
+                    }
+                    throw std::system_error(errno, std::generic_category(), "accept");
+                }
+            };
+            // false - соединение пора закрыть. Пока ответы не ушли, новые запросы не читаются:
+            // так память под ответы медленного клиента ограничена одним блоком
+            auto serve = [&](ClientConnection& connection, uint32_t events) {
+                try {
+                    if ((events & EPOLLOUT) != 0 && !connection.Send()) {
+                        return false;
+                    }
+                    if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0 && !connection.HasResponses()) {
+                        if (!connection.Receive(reader, converter, hit_counter, cache) || !connection.Send()) {
+                            return false;
+                        }
+                    }
+                    watch(EPOLL_CTL_MOD, connection.Fd(), connection.HasResponses() ? EPOLLOUT : EPOLLIN);
+                    return true;
+                } catch (const std::system_error& e) {
+                    std::cerr << e.what() << std::endl;
+                    return false;
+                }
+            };
+
+            epoll_event events[64];
+            for (;;) {
+                const int ready = epoll_wait(poller.Get(), events, std::size(events), -1);
+                if (ready < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::system_error(errno, std::generic_category(), "epoll_wait");
+                }
+                for (int i = 0; i < ready; ++i) {
+                    if (events[i].data.fd == listener.Get()) {
+                        accept_connections();
+                        continue;
+                    }
+                    const auto connection = connections.find(events[i].data.fd);
+                    if (connection != connections.end() && !serve(connection->second, events[i].events)) {
+                        // закрытие дескриптора само убирает его из epoll
+                        connections.erase(connection);
+                    }
+                }
+            }
+        } catch (...) {
+            const std::lock_guard lock(error_mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < workers_count; ++i) {
+        workers.emplace_back(worker, i % checker.Topology().NodeCount());
+    }
+    worker(0);
+    for (std::thread& thread : workers) {
+        thread.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+// Нагрузочный клиент: отправляет запросы пачками по batch_size штук, не дожидаясь ответов
+// на отдельные строки, и печатает перцентили времени ответа на пачку. Пачка отправляется по частям
+// вперемешку с чтением ответов: иначе на большой пачке сервер упёрся бы в полный буфер ответов,
+// а клиент - в полный буфер запросов, и оба ждали бы друг друга
+void RunLoadClient(std::string_view socket_path, const std::vector<Domain>& queries, size_t batch_size,
+                   std::ostream& out) {
+    FileDescriptor connection(socket(AF_UNIX, SOCK_STREAM, 0));
+    const sockaddr_un address = MakeSocketAddress(socket_path);
+    if (connect(connection.Get(), reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0) {
+        throw std::system_error(errno, std::generic_category(), "connect");
+    }
+
+    std::vector<std::string> names;
+    names.reserve(queries.size());
+    for (const Domain& domain : queries) {
+        std::ostringstream name;
+        name << domain;
+        names.push_back(name.str());
+    }
+
+    using Clock = std::chrono::steady_clock;
+    std::vector<double> latencies;
+    size_t forbidden_count = 0;
+    std::string request;
+    char buffer[64 * 1024];
+    const auto start = Clock::now();
+    for (size_t first = 0; first < names.size(); first += batch_size) {
+        const size_t last = std::min(names.size(), first + batch_size);
+        request.clear();
+        for (size_t i = first; i < last; ++i) {
+            request += names[i];
+            request += '\n';
+        }
+
+        const auto batch_start = Clock::now();
+        size_t sent = 0;
+        for (size_t answers = 0; answers < last - first;) {
+            pollfd events{connection.Get(), static_cast<short>(POLLIN | (sent < request.size() ? POLLOUT : 0)), 0};
+            if (poll(&events, 1, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error(errno, std::generic_category(), "poll");
+            }
+            if ((events.revents & POLLOUT) != 0) {
+                const ssize_t written = send(connection.Get(), request.data() + sent, request.size() - sent,
+                                             MSG_NOSIGNAL | MSG_DONTWAIT);
+                if (written >= 0) {
+                    sent += static_cast<size_t>(written);
+                } else if (errno == EPIPE || errno == ECONNRESET) {
+                    throw std::runtime_error("server closed the connection");
+                } else if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+                    throw std::system_error(errno, std::generic_category(), "send");
+                }
+            }
+            if ((events.revents & (POLLIN | POLLHUP | POLLERR)) != 0) {
+                const ssize_t received = read(connection.Get(), buffer, sizeof(buffer));
+                if (received < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (received <= 0) {
+                    throw std::runtime_error("server closed the connection");
+                }
+                for (ssize_t i = 0; i < received; ++i) {
+                    answers += buffer[i] == '\n';
+                    forbidden_count += buffer[i] == 'B';
+                }
+            }
+        }
+        latencies.push_back(std::chrono::duration<double, std::micro>(Clock::now() - batch_start).count());
+    }
+    const double total_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    if (latencies.empty()) {
+        return;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](double p) {
+        return latencies[std::min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()))];
+    };
+    out << "queries: "sv << names.size() << ", forbidden: "sv << forbidden_count
+        << ", batch: "sv << batch_size << ", qps: "sv << names.size() / total_seconds << '\n'
+        << "batch latency, us: p50 "sv << percentile(0.5) << ", p90 "sv << percentile(0.9)
+        << ", p99 "sv << percentile(0.99) << ", max "sv << latencies.back() << std::endl;
+}
+#endif
+
+// ********************************** Бенчмарки ****************************************************
+// Генерирует правдоподобные имена доменов: 1-3 метки из строчных букв и распространённый домен верхнего уровня
+class DomainGenerator {
+public:
+    explicit DomainGenerator(uint32_t seed) : random_(seed) {
+    }
+
+    std::string Next() {
+        static constexpr std::string_view kTopLevelDomains[] = {"com"sv, "net"sv, "org"sv, "ru"sv, "de"sv,
+                                                                "info"sv, "io"sv, "xyz"sv, "co.uk"sv, "com.br"sv};
+        std::string name;
+        const size_t labels_count = 1 + random_() % 3;
+        for (size_t i = 0; i < labels_count; ++i) {
+            const size_t label_size = 3 + random_() % 12;
+            for (size_t j = 0; j < label_size; ++j) {
+                name += static_cast<char>('a' + random_() % 26);
+            }
+            name += '.';
+        }
+        name += kTopLevelDomains[random_() % std::size(kTopLevelDomains)];
+        return name;
+    }
+
+    // запрос, с вероятностью 1/2 являющийся поддоменом одного из forbidden_names
+    std::string NextQuery(const std::vector<std::string>& forbidden_names) {
+        if (forbidden_names.empty() || random_() % 2) {
+            return Next();
+        }
+        return "www."s + forbidden_names[random_() % forbidden_names.size()];
+    }
+private:
+    std::mt19937 random_;
+};
+
+// Аппаратные счётчики производительности текущего потока (только пользовательский режим). Счётчики,
+// которые нельзя открыть - нет прав, поддержки процессора или виртуальной машины, - пропускаются
+class PerfCounters {
+public:
+    PerfCounters() {
+#ifdef __linux__
+        static constexpr uint64_t kDtlbReadMiss = PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                                                  PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+        const Event events[] = {{"cycles"sv, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+                                {"instructions"sv, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+                                {"cache-misses"sv, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+                                {"branch-misses"sv, PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+                                {"dTLB-load-misses"sv, PERF_TYPE_HW_CACHE, kDtlbReadMiss}};
+        for (const Event& event : events) {
+            perf_event_attr attributes{};
+            attributes.size = sizeof(attributes);
+            attributes.type = event.type;
+            attributes.config = event.config;
+            attributes.disabled = 1;
+            attributes.exclude_kernel = 1;
+            attributes.exclude_hv = 1;
+            const int fd = static_cast<int>(syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0));
+            if (fd >= 0) {
+                counters_.push_back({event.name, fd});
+            }
+        }
+#endif
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    ~PerfCounters() {
+#ifdef __linux__
+        for (const Counter& counter : counters_) {
+            close(counter.fd);
+        }
+#endif
+    }
+
+    void Start() {
+#ifdef __linux__
+        for (const Counter& counter : counters_) {
+            ioctl(counter.fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(counter.fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    // останавливает счётчики и возвращает их значения с момента Start
+    std::vector<std::pair<std::string_view, uint64_t>> Stop() {
+        std::vector<std::pair<std::string_view, uint64_t>> values;
+#ifdef __linux__
+        for (const Counter& counter : counters_) {
+            ioctl(counter.fd, PERF_EVENT_IOC_DISABLE, 0);
+            uint64_t value = 0;
+            if (read(counter.fd, &value, sizeof(value)) == sizeof(value)) {
+                values.emplace_back(counter.name, value);
+            }
+        }
+#endif
+        return values;
+    }
+private:
+    struct Event {
+        std::string_view name;
+        uint32_t type;
+        uint64_t config;
+    };
+
+    struct Counter {
+        std::string_view name;
+        int fd;
+    };
+
+    std::vector<Counter> counters_;
+};
+
+// Замеряет время вызова body, обрабатывающего queries_count запросов, и печатает время и значения
+// аппаратных счётчиков в пересчёте на запрос
+template <typename Body>
+void Benchmark(std::string_view name, size_t queries_count, Body body, std::ostream& out) {
+    using Clock = std::chrono::steady_clock;
+    PerfCounters counters;
+    counters.Start();
+    const auto start = Clock::now();
+    const size_t forbidden_count = body();
+    const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    const auto counter_values = counters.Stop();
+
+    out << name << ": "sv << seconds * 1e9 / queries_count << " ns/query, "sv
+        << queries_count / seconds / 1e6 << " Mqueries/s, forbidden: "sv << forbidden_count << std::endl;
+    if (counter_values.empty()) {
+        out << "    perf counters: n/a"sv << std::endl;
+        return;
+    }
+    out << "    per query:"sv;
+    for (const auto& [counter_name, value] : counter_values) {
+        out << ' ' << counter_name << ' ' << static_cast<double>(value) / queries_count;
+    }
+    out << std::endl;
+}
+
+// Сравнивает пропускную способность движков проверки на синтетическом списке из forbidden_count доменов
+void RunBenchmarks(size_t forbidden_count, std::ostream& out) {
+    static constexpr size_t kQueriesCount = 1'000'000;
+
+    DomainGenerator generator(42);
+    std::vector<std::string> forbidden_names(forbidden_count);
+    for (std::string& name : forbidden_names) {
+        name = generator.Next();
+    }
+    std::vector<Domain> queries;
+    queries.reserve(kQueriesCount);
+    for (size_t i = 0; i < kQueriesCount; ++i) {
+        queries.emplace_back(generator.NextQuery(forbidden_names));
+    }
+    const DomainChecker checker(forbidden_names.begin(), forbidden_names.end());
+    out << "forbidden domains: "sv << forbidden_count << ", queries: "sv << kQueriesCount << std::endl;
+    if (HugePages::IsEnabled()) {
+        out << "huge pages: explicit "sv << HugePages::ExplicitBytes() / (1 << 20) << " MB, transparent "sv
+            << HugePages::TransparentBytes() / (1 << 20) << " MB"sv << std::endl;
+    }
+
+    Benchmark("IsForbidden"sv, queries.size(), [&] {
+        size_t count = 0;
+        for (const Domain& domain : queries) {
+            count += checker.IsForbidden(domain);
+        }
+        return count;
+    }, out);
+
+    Benchmark("IsForbiddenBatch"sv, queries.size(), [&] {
+        std::unique_ptr<bool[]> verdicts(new bool[queries.size()]);
+        checker.IsForbiddenBatch(queries, std::span(verdicts.get(), queries.size()));
+        return static_cast<size_t>(std::count(verdicts.get(), verdicts.get() + queries.size(), true));
+    }, out);
+
+    const FrontCodedDomainChecker front_coded_checker(checker);
+    out << "memory: DomainChecker "sv << checker.MemoryUsage() / (1 << 20) << " MB, FrontCodedDomainChecker "sv
+        << front_coded_checker.MemoryUsage() / (1 << 20) << " MB"sv << std::endl;
+    Benchmark("FrontCodedDomainChecker"sv, queries.size(), [&] {
+        size_t count = 0;
+        for (const Domain& domain : queries) {
+            count += front_coded_checker.IsForbidden(domain);
+        }
+        return count;
+    }, out);
+
+    Benchmark("IsForbiddenJoin"sv, queries.size(), [&] {
+        std::unique_ptr<bool[]> verdicts(new bool[queries.size()]);
+        checker.IsForbiddenJoin(queries, std::span(verdicts.get(), queries.size()));
+        return static_cast<size_t>(std::count(verdicts.get(), verdicts.get() + queries.size(), true));
+    }, out);
+    for (size_t divisor : {10, 100}) {
+        const std::span<const Domain> part = std::span(queries).first(queries.size() / divisor);
+        const std::string suffix = ", 1/"s + std::to_string(divisor) + " of queries"s;
+        Benchmark("IsForbiddenBatch"s + suffix, part.size(), [&] {
+            std::unique_ptr<bool[]> verdicts(new bool[part.size()]);
+            checker.IsForbiddenBatch(part, std::span(verdicts.get(), part.size()));
+            return static_cast<size_t>(std::count(verdicts.get(), verdicts.get() + part.size(), true));
+        }, out);
+        Benchmark("IsForbiddenJoin"s + suffix, part.size(), [&] {
+            std::unique_ptr<bool[]> verdicts(new bool[part.size()]);
+            checker.IsForbiddenJoin(part, std::span(verdicts.get(), part.size()));
+            return static_cast<size_t>(std::count(verdicts.get(), verdicts.get() + part.size(), true));
+        }, out);
+    }
+
+    // перекошенный поток: 90% запросов приходятся на 10 000 горячих доменов
+    static constexpr size_t kHotCount = 10'000;
+    std::mt19937_64 random(7);
+    std::vector<const Domain*> skewed_queries(kQueriesCount);
+    for (const Domain*& query : skewed_queries) {
+        const size_t index = random() % 10 != 0 ? random() % kHotCount : random() % queries.size();
+        query = &queries[index];
+    }
+    Benchmark("IsForbidden, skewed"sv, skewed_queries.size(), [&] {
+        size_t count = 0;
+        for (const Domain* domain : skewed_queries) {
+            count += checker.IsForbidden(*domain);
+        }
+        return count;
+    }, out);
+    const CachedDomainChecker cached_checker(checker, 4 * kHotCount);
+    Benchmark("CachedDomainChecker, skewed"sv, skewed_queries.size(), [&] {
+        size_t count = 0;
+        for (const Domain* domain : skewed_queries) {
+            count += cached_checker.IsForbidden(*domain);
+        }
+        return count;
+    }, out);
+    out << "    cache hit rate: "sv << cached_checker.Cache().HitRate() << std::endl;
+}
+
+// ********************************** Тесты *******************************************************
+std::ostream& operator<<(std::ostream& out, const Domain& domain) {
+    out << domain.domain_name_.View();
+    return out;
+}
+
+template <typename Allocator>
+std::ostream& operator<<(std::ostream& out, const std::vector<Domain, Allocator>& domains) {
+    for(const Domain& domain : domains) {
+        out << domain << std::endl;
+    }
+    return out;
+}
+
+std::ostream& operator<<(std::ostream& out, const DomainChecker& checker) {
+    out << checker.forbidden_domains_;
+    return out;
+}
+
+void TestDomain() {
+    // тестирование конструктора и оператора ==
+    {
+        std::string s1("com"sv);
+        std::string s2("ru"sv);
+        std::ostringstream ostr_stream;
+        
+        Domain domain1(s1);
+        ostr_stream << domain1;
+        assert(ostr_stream.str() == s1);
+        ostr_stream.str("");
+        ostr_stream.clear();
+
+        Domain domain2(s2);
+        ostr_stream << domain2;
+        assert(ostr_stream.str() == s2);
+        assert(domain1 != domain2);
+    }
+    {
+        std::string s1("com"sv);
+        std::string s2("com"sv);
+        Domain domain1(s1);
+        Domain domain2(s2);
+        assert(domain1 == domain2);
+    }
+    // тестирование IsSubdomain
+    {
+        Domain domain("com"sv);
+        Domain subdomain("duck.com"sv);
+        assert(subdomain.IsSubdomain(domain) == true);
+        Domain not_subdomain("duck.ru"sv);
+        assert(not_subdomain.IsSubdomain(domain) == false);
+    }
+    {
+        Domain domain("com"sv);
+        Domain subdomain("alter.duck.com"sv);
+        assert(subdomain.IsSubdomain(domain));
+    }
+    {
+        Domain domain("class.com"sv);
+        Domain subdomain("class.com"sv);
+        assert(subdomain.IsSubdomain(domain) == true);
+        Domain not_subdomain("class.ru"sv);
+        assert(not_subdomain.IsSubdomain(domain) == false);
+    }
+    {
+        Domain domain("class.com"sv);
+        Domain subdomain("duck.class.com"sv);
+        assert(subdomain.IsSubdomain(domain));
+        Domain not_subdomain("duck.com"sv);
+        assert(not_subdomain.IsSubdomain(domain) == false);
+    }
+}
+
+void TestDomainName() {
+    // короткие имена хранятся внутри объекта
+    {
+        DomainName name("maps.yandex.ru"sv);
+        assert(!name.IsOnHeap());
+        assert(name.View() == "maps.yandex.ru"sv);
+    }
+    // граница встроенной ёмкости и переход в кучу
+    {
+        const std::string inline_name(DomainName::kInlineCapacity, 'a');
+        const std::string heap_name(DomainName::kInlineCapacity + 1, 'b');
+        DomainName name1(inline_name);
+        DomainName name2(heap_name);
+        assert(!name1.IsOnHeap() && name1.View() == inline_name);
+        assert(name2.IsOnHeap() && name2.View() == heap_name);
+    }
+    // копирование и перемещение
+    {
+        const std::string long_name = "very.long.subdomain.of.some.example.domain.com"s;
+        DomainName name(long_name);
+        DomainName copy(name);
+        assert(copy.View() == long_name && copy.View().data() != name.View().data());
+
+        DomainName moved(std::move(name));
+        assert(moved.View() == long_name);
+
+        DomainName short_name("ru"sv);
+        short_name = moved;
+        assert(short_name.View() == long_name);
+        moved = DomainName("com"sv);
+        assert(moved.View() == "com"sv && !moved.IsOnHeap());
+    }
+    // пустое имя
+    {
+        DomainName name(""sv);
+        assert(name.View().empty() && !name.IsOnHeap());
+    }
+}
+
+void TestSortKey() {
+    const std::vector<Domain> domains = {""sv, "ru"sv, ".ru"sv, "a.ru"sv, "-.ru"sv, "cru"sv, "a.cru"sv,
+                                         "yandex.ru"sv, "maps.yandex.ru"sv, "a.yandex.ru"sv, "\x80.ru"sv,
+                                         "\x81.ru"sv, "\x01.ru"sv, "\x7F.ru"sv, "b.ru"sv, "com"sv
+    };
+    for (const Domain& lhs : domains) {
+        for (const Domain& rhs : domains) {
+            if (lhs < rhs) {
+                assert(lhs.SortKey() <= rhs.SortKey());
+            }
+        }
+    }
+    assert(Domain("ru"sv).SortKey() < Domain(".ru"sv).SortKey());
+    assert(Domain("a.ru"sv).SortKey() < Domain("b.ru"sv).SortKey());
+}
+
+void TestReadDomains() {
+    std::ostringstream str_out;
+    // тестирование чтения не из пустого потока
+    {
+        const std::vector<Domain> domains = {"gdz.ru"sv,
+                                             "gdz.com"sv,
+                                             "m.maps.me"sv,
+                                             "alg.m.gdz.ru"sv,
+                                             "maps.com"sv,
+                                             "maps.ru"sv,
+                                             "gdz.ua"sv
+        };
+        str_out << domains;
+
+        std::istringstream in_str(str_out.str());
+    
+        const std::vector<Domain> test_domains = ReadDomains(in_str, domains.size());
+        assert(test_domains == domains);
+    }
+    // тестирование чтения из пустого потока
+    {
+        std::istringstream in_str;
+        const std::vector<Domain> test_domains = ReadDomains(in_str, 0);
+        assert(test_domains == std::vector<Domain>{});
+    }
+}
+
+void TestDomainChecker() {
+    std::ostringstream out_str;
+    const std::vector<Domain> domains = {"gdz.ua"sv,
+                                         "gdz.ub"sv,
+                                         "gdz.uc"sv,
+                                         "gdz.ud"sv,
+                                         "gdz.uf"sv,
+                                         "gdz.ug"sv
+    };
+    DomainChecker checker(domains.begin(), domains.end());
+    out_str << checker;
+
+    std::ostringstream out_str2;
+    out_str2 << domains;
+
+    std::string s1 = out_str.str();
+    std::string s2 = out_str2.str();
+
+    assert(out_str.str() == out_str2.str());
+}
+
+void TestIsForbidden() {
+    const std::vector<Domain> test_domains = {"gdz.ru"sv,
+                                              "gdz.com"sv,
+                                              "m.maps.me"sv,
+                                              "alg.m.gdz.ru"sv,
+                                              "maps.com"sv,
+                                              "maps.ru"sv,
+                                              "gdz.ua"sv
+    };
+    // тестирование при непустом списке запрещённых доменов
+    {
+        std::ostringstream out_str;
+        const std::vector<Domain> forbidden_domains = {"gdz.ru"sv,
+                                                       "maps.me"sv,
+                                                       "m.gdz.ru"sv,
+                                                       "com"sv
+        };
+        DomainChecker checker(forbidden_domains.begin(), forbidden_domains.end());
+
+        for (const Domain& domain : test_domains) {
+            out_str << (checker.IsForbidden(domain) ? "Bad"sv : "Good"sv) << std::endl;
+        }
+        assert(out_str.str() == "Bad\nBad\nBad\nBad\nBad\nGood\nGood\n"sv);
+    }
+    // тестирование при пустом списке запрещённых доменов
+    {
+        std::ostringstream out_str;
+        const std::vector<Domain> forbidden_domains = {};
+        DomainChecker checker(forbidden_domains.begin(), forbidden_domains.end());
+
+        for (const Domain& domain : test_domains) {
+            out_str << (checker.IsForbidden(domain) ? "Bad"sv : "Good"sv) << std::endl;
+        }
+        assert(out_str.str() == "Good\nGood\nGood\nGood\nGood\nGood\nGood\n"sv);
+    }
+}
+
+void TestMatchModes() {
+    const std::vector<ForbiddenRule> rules = {{"login.example.com"sv, MatchMode::kExact},
+                                              {"x.login.example.com"sv, MatchMode::kSubtree},
+                                              {"gdz.ru"sv, MatchMode::kSubtree},
+                                              {"m.gdz.ru"sv, MatchMode::kExact},
+                                              {"maps.me"sv, MatchMode::kExact},
+                                              {"maps.me"sv, MatchMode::kSubtree},
+                                              {"a.com"sv, MatchMode::kExact},
+                                              {"a.com"sv, MatchMode::kExact}
+    };
+    const DomainChecker checker(rules.begin(), rules.end());
+    // правила под gdz.ru и повтор a.com выброшены, из двух maps.me остался kSubtree
+    assert(checker.RuleCount() == 5);
+
+    assert(checker.IsForbidden("login.example.com"sv));
+    assert(!checker.IsForbidden("y.login.example.com"sv));
+    assert(checker.IsForbidden("x.login.example.com"sv));
+    assert(checker.IsForbidden("z.x.login.example.com"sv));
+    assert(checker.IsForbidden("m.gdz.ru"sv) && checker.IsForbidden("a.m.gdz.ru"sv));
+    assert(checker.IsForbidden("w.maps.me"sv));
+    assert(checker.IsForbidden("a.com"sv) && !checker.IsForbidden("b.a.com"sv) && !checker.IsForbidden("com"sv));
+}
+
+void TestFrontCodedDomainChecker() {
+    DomainGenerator generator(13);
+    std::vector<std::string> names;
+    for (size_t i = 0; i < 3000; ++i) {
+        names.push_back(generator.Next());
+        // длинные общие концы внутри корзин
+        names.push_back("host"s + std::to_string(i) + ".cdn.example.com"s);
+    }
+    names.push_back(std::string(100, 'a') + ".long.com"s);
+    const DomainChecker checker(names.begin(), names.end());
+    const FrontCodedDomainChecker front_coded(checker);
+    assert(front_coded.RuleCount() == checker.RuleCount());
+    assert(front_coded.MemoryUsage() < checker.MemoryUsage() / 2);
+
+    std::vector<Domain> queries;
+    for (size_t i = 0; i < 3000; ++i) {
+        queries.emplace_back(generator.NextQuery(names));
+        queries.emplace_back("x.host"s + std::to_string(i * 7) + ".cdn.example.com"s);
+    }
+    queries.emplace_back("b."s + std::string(100, 'a') + ".long.com"s);
+    queries.emplace_back(""sv);
+    queries.emplace_back("a"sv);
+    std::unique_ptr<bool[]> verdicts(new bool[queries.size()]);
+    front_coded.IsForbiddenBatch(queries, std::span(verdicts.get(), queries.size()));
+    for (size_t i = 0; i < queries.size(); ++i) {
+        assert(front_coded.IsForbidden(queries[i]) == checker.IsForbidden(queries[i]));
+        assert(verdicts[i] == checker.IsForbidden(queries[i]));
+    }
+
+    const std::vector<ForbiddenRule> rules = {{"login.example.com"sv, MatchMode::kExact}, {"gdz.ru"sv}};
+    const FrontCodedDomainChecker mixed(rules.begin(), rules.end());
+    assert(mixed.IsForbidden("login.example.com"sv) && !mixed.IsForbidden("a.login.example.com"sv));
+    assert(mixed.IsForbidden("m.gdz.ru"sv) && !mixed.IsForbidden("example.com"sv));
+
+    const std::vector<Domain> no_rules;
+    const FrontCodedDomainChecker empty(no_rules.begin(), no_rules.end());
+    assert(!empty.IsForbidden("a.com"sv) && empty.RuleCount() == 0);
+}
+
+void TestShardedDomainChecker() {
+    const std::vector<Domain> forbidden_domains = {"gdz.ru"sv,
+                                                   "maps.me"sv,
+                                                   "m.gdz.ru"sv,
+                                                   "com"sv,
+                                                   "cru"sv
+    };
+    const std::vector<Domain> test_domains = {"gdz.ru"sv,
+                                              "gdz.com"sv,
+                                              "m.maps.me"sv,
+                                              "alg.m.gdz.ru"sv,
+                                              "maps.com"sv,
+                                              "maps.ru"sv,
+                                              "gdz.ua"sv,
+                                              "ru"sv,
+                                              "x.cru"sv
+    };
+    // результаты совпадают с обычной проверкой
+    {
+        DomainChecker checker(forbidden_domains.begin(), forbidden_domains.end());
+        ShardedDomainChecker sharded_checker(forbidden_domains.begin(), forbidden_domains.end());
+        assert(sharded_checker.ShardCount() == 4);
+        for (const Domain& domain : test_domains) {
+            assert(sharded_checker.IsForbidden(domain) == checker.IsForbidden(domain));
+        }
+    }
+    // перезагрузка одной части не затрагивает остальные
+    {
+        ShardedDomainChecker sharded_checker(forbidden_domains.begin(), forbidden_domains.end());
+        const std::vector<Domain> ru_domains = {"maps.ru"sv};
+        sharded_checker.ReloadShard("ru"sv, ru_domains.begin(), ru_domains.end());
+        assert(sharded_checker.IsForbidden("maps.ru"sv));
+        assert(!sharded_checker.IsForbidden("gdz.ru"sv));
+        assert(sharded_checker.IsForbidden("gdz.com"sv));
+
+        const std::vector<Domain> ua_domains = {"gdz.ua"sv};
+        sharded_checker.ReloadShard("ua"sv, ua_domains.begin(), ua_domains.end());
+        assert(sharded_checker.IsForbidden("m.gdz.ua"sv));
+        assert(sharded_checker.ShardCount() == 5);
+    }
+}
+
+void TestMultiListDomainChecker() {
+    const std::vector<DomainList> lists = {{"malware"s, {"evil.com"sv, "bad.ru"sv}},
+                                           {"ads"s, {"com"sv, "ads.bad.ru"sv}},
+                                           {"tracking"s, {"evil.com"sv, "deep.a.com"sv}}
+    };
+    MultiListDomainChecker checker(lists);
+    assert(checker.ListCount() == 3 && checker.ListName(1) == "ads"s);
+
+    // правила разных списков не поглощают друг друга
+    assert(checker.Lookup("x.evil.com"sv) == 0b111);
+    assert(checker.Lookup("evil.com"sv) == 0b111);
+    assert(checker.Lookup("ads.bad.ru"sv) == 0b011);
+    assert(checker.Lookup("a.bad.ru"sv) == 0b001);
+    assert(checker.Lookup("x.deep.a.com"sv) == 0b110);
+    // ближайший сосед запроса не предок, предок находится по цепочке
+    assert(checker.Lookup("z.com"sv) == 0b010);
+    assert(checker.Lookup("a.com"sv) == 0b010);
+    assert(checker.Lookup("zzz.ru"sv) == 0);
+    assert(checker.Lookup("cru"sv) == 0);
+}
+
+void TestQueryCache() {
+    std::vector<Domain> forbidden = {"gdz.ru"sv, "maps.me"sv};
+    ReplicatedDomainChecker checker(NumaTopology::SingleNode(), forbidden.begin(), forbidden.end());
+    CachedDomainChecker cached_checker(checker, 64);
+    assert(cached_checker.Cache().Capacity() == 64);
+
+    assert(cached_checker.IsForbidden("m.gdz.ru"sv));
+    assert(!cached_checker.IsForbidden("gdz.com"sv));
+    assert(cached_checker.IsForbidden("m.gdz.ru"sv));
+    assert(!cached_checker.IsForbidden("gdz.com"sv));
+    assert(cached_checker.Cache().Hits() == 2 && cached_checker.Cache().Misses() == 2);
+    assert(cached_checker.Cache().HitRate() == 0.5);
+    std::ostringstream report;
+    WriteCacheStats(cached_checker.Cache(), report);
+    assert(report.str() == "cache: hits 2, misses 2, hit rate 0.5\n"sv);
+
+    // после перезагрузки старые ответы не используются
+    forbidden = {"gdz.com"sv};
+    cached_checker.Reload(forbidden.begin(), forbidden.end());
+    assert(!cached_checker.IsForbidden("m.gdz.ru"sv));
+    assert(cached_checker.IsForbidden("gdz.com"sv));
+    assert(cached_checker.Cache().Misses() == 4);
+
+    // ответ, посчитанный до перезагрузки, не попадает в кэш нового поколения
+    QueryCache cache(16);
+    const uint32_t old_generation = cache.Generation();
+    cache.Invalidate();
+    const uint64_t hash = QueryCache::Hash("a.com"sv);
+    cache.Insert(hash, old_generation, true);
+    assert(!cache.Find(hash, cache.Generation()));
+    cache.Insert(hash, cache.Generation(), false);
+    assert(cache.Find(hash, cache.Generation()) == std::optional<bool>(false));
+
+    // вытеснение: кэш на один набор держит не больше kWays записей, и ответы остаются верными
+    QueryCache small_cache(QueryCache::kWays);
+    for (int round = 0; round < 3; ++round) {
+        for (size_t i = 0; i < 4 * QueryCache::kWays; ++i) {
+            const Domain domain("d"s + std::to_string(i) + ".com"s);
+            assert(small_cache.GetOrCompute(domain, small_cache.Generation(), [i] { return i % 3 == 0; }) == (i % 3 == 0));
+        }
+    }
+    assert(small_cache.Hits() < small_cache.Misses());
+
+    // одновременные проверки из нескольких потоков
+    CachedDomainChecker shared_checker(checker, 256);
+    std::vector<std::thread> threads;
+    std::atomic<size_t> errors = 0;
+    for (size_t t = 0; t < 4; ++t) {
+        threads.emplace_back([&] {
+            for (size_t i = 0; i < 10'000; ++i) {
+                const Domain domain("x"s + std::to_string(i % 500) + (i % 2 ? ".gdz.com"s : ".gdz.ru"s));
+                errors += shared_checker.IsForbidden(domain) != (i % 2 == 1);
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    assert(errors == 0);
+    assert(shared_checker.Cache().Hits() + shared_checker.Cache().Misses() == 40'000);
+}
+
+void TestShardedHitCounter() {
+    const std::vector<Domain> forbidden_domains = {"gdz.ru"sv, "maps.me"sv, "com"sv};
+    DomainChecker checker(forbidden_domains.begin(), forbidden_domains.end());
+    ShardedHitCounter hit_counter(checker.RuleCount(), 4);
+
+    auto check = [&](size_t repeat, std::string_view name) {
+        for (size_t i = 0; i < repeat; ++i) {
+            checker.IsForbidden(Domain(name), hit_counter);
+        }
+    };
+    std::vector<std::thread> threads;
+    threads.emplace_back(check, 1000, "a.com"sv);
+    threads.emplace_back(check, 1000, "b.com"sv);
+    threads.emplace_back(check, 10, "m.gdz.ru"sv);
+    threads.emplace_back(check, 500, "maps.ru"sv);
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    const auto top = hit_counter.Top(5);
+    assert(top.size() == 2);
+    assert(checker.Rule(top[0].first) == Domain("com"sv) && top[0].second == 2000);
+    assert(checker.Rule(top[1].first) == Domain("gdz.ru"sv) && top[1].second == 10);
+
+    std::ostringstream report;
+    WriteTopRules(checker, hit_counter, 1, report);
+    assert(report.str() == "top 1 rules:\n2000 com\n"sv);
+}
+
+void TestLatencyHistogram() {
+    // корзины идут подряд без пропусков и пересечений
+    for (uint64_t value = 0; value < 100'000; ++value) {
+        const size_t index = LatencyHistogram::BucketIndex(value);
+        assert(LatencyHistogram::BucketLowerBound(index) <= value);
+        assert(value < LatencyHistogram::BucketLowerBound(index + 1));
+    }
+    assert(LatencyHistogram::BucketIndex(UINT64_MAX) == (64 - LatencyHistogram::kSubBucketBits + 1) * LatencyHistogram::kSubBuckets - 1);
+
+    LatencyHistogram histogram;
+    assert(histogram.Percentile(0.5) == 0);
+    for (uint64_t value = 1; value <= 1000; ++value) {
+        histogram.Record(value);
+    }
+    assert(histogram.Count() == 1000);
+    // относительная погрешность не больше 1/kSubBuckets
+    assert(histogram.Percentile(0.5) <= 501 && histogram.Percentile(0.5) * 17 >= 501 * 16);
+    assert(histogram.Percentile(0.99) <= 991 && histogram.Percentile(0.99) * 17 >= 991 * 16);
+    assert(histogram.Percentile(1.0) <= 1000 && histogram.Percentile(1.0) * 17 >= 1000 * 16);
+}
+
+void TestHugePageAllocator() {
+    const bool was_enabled = HugePages::IsEnabled();
+    for (bool enabled : {false, true}) {
+        HugePages::SetEnabled(enabled);
+        std::vector<uint64_t, HugePageAllocator<uint64_t>> small(16, 1);
+        std::vector<uint64_t, HugePageAllocator<uint64_t>> large(HugePages::kPageSize / sizeof(uint64_t) + 1, 2);
+        large.push_back(3);
+        assert(small.back() == 1 && large.front() == 2 && large.back() == 3);
+
+        const std::vector<Domain> domains = {"gdz.ru"sv, "com"sv};
+        const DomainChecker checker(domains.begin(), domains.end());
+        assert(checker.IsForbidden("maps.gdz.ru"sv) && !checker.IsForbidden("ru"sv));
+    }
+    HugePages::SetEnabled(was_enabled);
+}
+
+void TestReplicatedDomainChecker() {
+    assert((NumaTopology::ParseCpuList("0-3,8,10-11"sv) == std::vector<int>{0, 1, 2, 3, 8, 10, 11}));
+    assert(NumaTopology::ParseCpuList(""sv).empty());
+    assert(NumaTopology::Detect().NodeCount() >= 1);
+
+    const std::vector<Domain> old_domains = {"gdz.ru"sv, "com"sv};
+    const std::vector<Domain> new_domains = {"maps.me"sv};
+    ReplicatedDomainChecker checker(NumaTopology::Detect(), old_domains.begin(), old_domains.end());
+    assert(checker.IsForbidden("m.gdz.ru"sv) && !checker.IsForbidden("maps.me"sv));
+
+    const auto old_replicas = checker.Snapshot();
+    checker.Reload(new_domains.begin(), new_domains.end());
+    assert(!checker.IsForbidden("m.gdz.ru"sv) && checker.IsForbidden("maps.me"sv));
+    // взятое до перезагрузки поколение остаётся целым
+    for (const DomainChecker& replica : *old_replicas) {
+        assert(replica.IsForbidden("m.gdz.ru"sv) && !replica.IsForbidden("maps.me"sv));
+    }
+    for (const DomainChecker& replica : *checker.Snapshot()) {
+        assert(!replica.IsForbidden("m.gdz.ru"sv) && replica.IsForbidden("maps.me"sv));
+    }
+
+    // Reader обновляет своё поколение только после Reload
+    ReplicatedDomainChecker::Reader reader(checker, 0);
+    const uint64_t generation = checker.Generation();
+    assert(reader.Current().IsForbidden("maps.me"sv));
+    assert(&reader.Current() == &checker.Snapshot()->front());
+    checker.Reload(old_domains.begin(), old_domains.end());
+    assert(checker.Generation() != generation);
+    assert(reader.Current().IsForbidden("m.gdz.ru"sv) && !reader.Current().IsForbidden("maps.me"sv));
+    assert(checker.IsForbidden("m.gdz.ru"sv));
+
+    // другой checker со своими поколениями не путается с первым в кэше потока
+    ReplicatedDomainChecker other(NumaTopology::Detect(), new_domains.begin(), new_domains.end());
+    assert(other.IsForbidden("maps.me"sv) && !other.IsForbidden("m.gdz.ru"sv));
+    assert(checker.IsForbidden("m.gdz.ru"sv) && !checker.IsForbidden("maps.me"sv));
+}
+
+void TestWorkStealingPool() {
+    WorkStealingPool pool(4);
+    // неравные по времени части и вложенные задачи
+    {
+        std::vector<std::atomic<int>> visits(10'000);
+        pool.ParallelFor(0, visits.size(), 7, [&](size_t first, size_t last) {
+            for (size_t i = first; i < last; ++i) {
+                ++visits[i];
+            }
+            if (first % 2 == 0) {
+                std::this_thread::sleep_for(std::chrono::microseconds(10));
+            }
+        });
+        assert(std::all_of(visits.begin(), visits.end(), [](const std::atomic<int>& count) { return count == 1; }));
+    }
+    // исключение из задачи пробрасывается в Wait
+    {
+        bool thrown = false;
+        try {
+            pool.ParallelFor(0, 100, 1, [](size_t first, size_t) {
+                if (first == 42) {
+                    throw std::runtime_error("task failed");
+                }
+            });
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+    // параллельное построение совпадает с обычным
+    {
+        DomainGenerator generator(11);
+        std::vector<Domain> domains;
+        for (size_t i = 0; i < 100'000; ++i) {
+            domains.emplace_back(i % 100 == 0 ? "com"s : generator.Next());
+        }
+        const DomainChecker checker(domains.begin(), domains.end());
+        const DomainChecker parallel_checker(domains, pool);
+        std::ostringstream out, parallel_out;
+        out << checker;
+        parallel_out << parallel_checker;
+        assert(out.str() == parallel_out.str());
+    }
+}
+
+void TestCheckDomainsParallel() {
+    const std::string input = "4\ngdz.ru\nmaps.me\nm.gdz.ru\ncom\n7\ngdz.ru\ngdz.com\nm.maps.me\nalg.m.gdz.ru\n"
+                              "maps.com\nmaps.ru\ngdz.ua"s;
+    WorkStealingPool pool(3);
+    for (VerdictEncoder::Format format : {VerdictEncoder::Format::kText, VerdictEncoder::Format::kBitmap,
+                                          VerdictEncoder::Format::kIndices}) {
+        std::istringstream in(input), parallel_in(input);
+        std::ostringstream out, parallel_out;
+        const std::vector<Domain> forbidden_domains = ReadDomains(in, ReadNumberOnLine<size_t>(in));
+        const DomainChecker checker(forbidden_domains.begin(), forbidden_domains.end());
+        WriteVerdicts(checker, ReadDomains(in, ReadNumberOnLine<size_t>(in)), format, out);
+        CheckDomainsParallel(parallel_in, parallel_out, format, pool);
+        assert(out.str() == parallel_out.str());
+
+        // список задан отдельно, во входе только запросы
+        std::istringstream queries_in(input.substr(input.find("7\n"sv)));
+        std::ostringstream queries_out;
+        CheckDomainsParallel(queries_in, queries_out, format, pool, &checker);
+        assert(out.str() == queries_out.str());
+    }
+
+    // несколько частей по 16K запросов и неполная последняя; число запросов не кратно 8,
+    // поэтому последний байт битовой карты неполный
+    DomainGenerator generator(11);
+    std::vector<std::string> names;
+    for (size_t i = 0; i < 2'000; ++i) {
+        names.push_back(generator.Next());
+    }
+    std::string large_input = std::to_string(names.size()) + "\n"s;
+    for (const std::string& name : names) {
+        large_input += name + "\n"s;
+    }
+    static constexpr size_t kQueriesCount = 2 * 16 * 1024 + 1003;
+    large_input += std::to_string(kQueriesCount) + "\n"s;
+    for (size_t i = 0; i < kQueriesCount; ++i) {
+        large_input += generator.NextQuery(names) + "\n"s;
+    }
+    for (VerdictEncoder::Format format : {VerdictEncoder::Format::kText, VerdictEncoder::Format::kBitmap,
+                                          VerdictEncoder::Format::kIndices}) {
+        std::istringstream in(large_input), parallel_in(large_input);
+        std::ostringstream out, parallel_out;
+        const std::vector<Domain> forbidden_domains = ReadDomains(in, ReadNumberOnLine<size_t>(in));
+        const DomainChecker checker(forbidden_domains.begin(), forbidden_domains.end());
+        WriteVerdicts(checker, ReadDomains(in, ReadNumberOnLine<size_t>(in)), format, out);
+        CheckDomainsParallel(parallel_in, parallel_out, format, pool);
+        assert(out.str() == parallel_out.str());
+    }
+}
+
+// простое рекурсивное сопоставление с шаблоном для проверки автомата
+bool MatchesPatternReference(std::string_view pattern, std::string_view name) {
+    if (pattern.empty()) {
+        return name.empty();
+    }
+    if (pattern.front() == '*') {
+        return MatchesPatternReference(pattern.substr(1), name) ||
+               (!name.empty() && MatchesPatternReference(pattern, name.substr(1)));
+    }
+    return !name.empty() && (pattern.front() == '?' ? name.front() != '.' : pattern.front() == name.front()) &&
+           MatchesPatternReference(pattern.substr(1), name.substr(1));
+}
+
+void TestPatternAutomaton() {
+    {
+        const PatternAutomaton automaton({"ads*.example.com"s, "*.cdn-??.net"s});
+        assert(automaton.Matches("ads.example.com"sv));
+        assert(automaton.Matches("ads1.example.com"sv));
+        assert(automaton.Matches("ads.x.example.com"sv));
+        assert(!automaton.Matches("x.ads.example.com"sv));
+        assert(automaton.Matches("a.b.cdn-01.net"sv));
+        assert(!automaton.Matches("cdn-01.net"sv));
+        assert(!automaton.Matches("a.cdn-1.net"sv));
+        assert(!automaton.Matches("a.cdn-.x.net"sv));
+    }
+    // сравнение с простым сопоставлением на случайных шаблонах, в том числе длиннее машинного слова
+    std::mt19937 random(5);
+    auto random_string = [&random](std::string_view alphabet, size_t max_size) {
+        std::string result(random() % (max_size + 1), ' ');
+        for (char& c : result) {
+            c = alphabet[random() % alphabet.size()];
+        }
+        return result;
+    };
+    for (size_t round = 0; round < 200; ++round) {
+        std::vector<std::string> patterns;
+        for (size_t i = random() % 12; i > 0; --i) {
+            patterns.push_back(random_string("ab.*?"sv, 10));
+        }
+        const PatternAutomaton automaton(patterns);
+        for (size_t i = 0; i < 50; ++i) {
+            const std::string name = random_string("ab."sv, 8);
+            const bool expected = std::any_of(patterns.begin(), patterns.end(), [&name](const std::string& pattern) {
+                return MatchesPatternReference(pattern, name);
+            });
+            assert(automaton.Matches(name) == expected);
+        }
+    }
+}
+
+void TestExtendedDomainChecker() {
+    const std::vector<Domain> rules = {"gdz.ru"sv, "=login.example.com"sv, "ads*.example.com"sv, "*.cdn-??.net"sv,
+                                       "tracker.*"sv
+    };
+    const ExtendedDomainChecker checker(rules.begin(), rules.end());
+    assert(checker.IsForbidden("maps.gdz.ru"sv));
+    assert(checker.IsForbidden("login.example.com"sv));
+    assert(!checker.IsForbidden("x.login.example.com"sv));
+    assert(checker.IsForbidden("ads7.example.com"sv));
+    assert(!checker.IsForbidden("example.com"sv));
+    assert(checker.IsForbidden("img.cdn-eu.net"sv));
+    assert(checker.IsForbidden("tracker.io"sv));
+    assert(!checker.IsForbidden("ru"sv));
+
+    const std::vector<Domain> queries = {"maps.gdz.ru"sv, "x.login.example.com"sv, "tracker.io"sv, "a.cdn-eu.net"sv};
+    bool verdicts[4];
+    checker.IsForbiddenBatch(queries, verdicts);
+    assert(verdicts[0] && !verdicts[1] && verdicts[2] && verdicts[3]);
+}
+
+void TestPublicSuffixList() {
+    const std::vector<std::string> rules = {"// ===BEGIN ICANN DOMAINS==="s, ""s, "com"s, "uk"s, "co.uk"s, "jp"s,
+                                            "*.kobe.jp"s, "!city.kobe.jp"s, "*.ck"s, "!www.ck"s, "co.uk"s,
+                                            "hk"s, "公司.hk"s, "рф"s, "*.ПРИМЕР.рф"s};
+    const PublicSuffixList list(rules.begin(), rules.end());
+    assert(list.RuleCount() == 12);
+
+    // юникодные правила сравниваются с запросами, уже переведёнными в пуникод
+    IdnaConverter converter;
+    assert(list.RegistrableDomain(converter.ToAscii("www.example.公司.hk"sv)) == "example.xn--55qx5d.hk"sv);
+    assert(list.RegistrableDomain("example.xn--55qx5d.hk"sv) == "example.xn--55qx5d.hk"sv);
+    assert(list.RegistrableDomain("xn--55qx5d.hk"sv).empty());
+    assert(list.RegistrableDomain(converter.ToAscii("сайт.рф"sv)) == "xn--80aswg.xn--p1ai"sv);
+    assert(list.RegistrableDomain(converter.ToAscii("a.b.пример.рф"sv)) == "a.b.xn--e1afmkfd.xn--p1ai"sv);
+
+    assert(list.RegistrableDomain("example.com"sv) == "example.com"sv);
+    assert(list.RegistrableDomain("a.b.example.com"sv) == "example.com"sv);
+    assert(list.RegistrableDomain("com"sv).empty());
+    assert(list.RegistrableDomain("www.bbc.co.uk"sv) == "bbc.co.uk"sv);
+    assert(list.RegistrableDomain("co.uk"sv).empty());
+    assert(list.PublicSuffix("www.bbc.co.uk"sv) == "co.uk"sv);
+
+    // подстановочное правило и исключение из него
+    assert(list.RegistrableDomain("kobe.jp"sv) == "kobe.jp"sv);
+    assert(list.RegistrableDomain("c.kobe.jp"sv).empty());
+    assert(list.RegistrableDomain("b.c.kobe.jp"sv) == "b.c.kobe.jp"sv);
+    assert(list.RegistrableDomain("a.b.c.kobe.jp"sv) == "b.c.kobe.jp"sv);
+    assert(list.RegistrableDomain("city.kobe.jp"sv) == "city.kobe.jp"sv);
+    assert(list.RegistrableDomain("www.city.kobe.jp"sv) == "city.kobe.jp"sv);
+    assert(list.RegistrableDomain("www.ck"sv) == "www.ck"sv);
+    assert(list.RegistrableDomain("a.www.ck"sv) == "www.ck"sv);
+    assert(list.RegistrableDomain("a.b.ck"sv) == "a.b.ck"sv);
+
+    // неизвестный домен верхнего уровня - правило "*" по умолчанию
+    assert(list.RegistrableDomain("shop.example.xyz"sv) == "example.xyz"sv);
+    assert(list.PublicSuffix("example.xyz"sv) == "xyz"sv);
+    assert(list.RegistrableDomain("xyz"sv).empty());
+    assert(list.RegistrableDomain(""sv).empty());
+    assert(list.RegistrableDomain(".com"sv).empty());
+
+    const std::vector<Domain> queries = {"www.bbc.co.uk"sv, "uk"sv, "a.b.c.kobe.jp"sv};
+    std::array<std::string_view, 3> results;
+    list.RegistrableDomainBatch(queries, results);
+    assert(results[0] == "bbc.co.uk"sv && results[1].empty() && results[2] == "b.c.kobe.jp"sv);
+    // результат ссылается на имя запроса
+    assert(results[0].data() == queries[0].Name().data() + 4);
+
+    const std::vector<Domain> forbidden = {"bbc.co.uk"sv};
+    const DomainChecker checker(forbidden.begin(), forbidden.end());
+    std::ostringstream output;
+    WriteVerdictsWithRegistrable(checker, list, queries, output);
+    assert(output.str() == "Bad bbc.co.uk\nGood -\nGood b.c.kobe.jp\n"sv);
+}
+
+void TestIdnaConverter() {
+    IdnaConverter converter;
+    // уже каноническое имя возвращается без копирования
+    const std::string_view plain = "www.example.com"sv;
+    assert(converter.ToAscii(plain).data() == plain.data());
+    assert(converter.ToAscii("WWW.Example.COM"sv) == "www.example.com"sv);
+
+    assert(converter.ToAscii("bücher.de"sv) == "xn--bcher-kva.de"sv);
+    assert(converter.ToAscii("пример.рф"sv) == "xn--e1afmkfd.xn--p1ai"sv);
+    assert(converter.ToAscii("ПРИМЕР.РФ"sv) == "xn--e1afmkfd.xn--p1ai"sv);
+    assert(converter.ToAscii("www.MÜNCHEN.de"sv) == "www.xn--mnchen-3ya.de"sv);
+    assert(converter.ToAscii("例え.jp"sv) == "xn--r8jz45g.jp"sv);
+    assert(converter.ToAscii("XN--E1AFMKFD.xn--p1ai"sv) == "xn--e1afmkfd.xn--p1ai"sv);
+    // повтор из кэша
+    assert(converter.ToAscii("a.пример.рф"sv) == "a.xn--e1afmkfd.xn--p1ai"sv);
+
+    // некорректный UTF-8 и слишком длинные метки остаются как есть
+    assert(converter.ToAscii("\xC3.com"sv) == "\xC3.com"sv);
+    assert(converter.ToAscii("\xC0\x80.com"sv) == "\xC0\x80.com"sv);
+    const std::string long_label = "ü"s + std::string(70, 'a') + ".com"s;
+    assert(converter.ToAscii(long_label) == long_label);
+    assert(converter.ToAscii(""sv).empty());
+    assert(converter.ToAscii("A."sv) == "a."sv);
+    // слишком длинное имя не переводится, но приводится к нижнему регистру
+    std::string long_name, long_name_lower;
+    for (size_t i = 0; i < 200; ++i) {
+        long_name += "A."s;
+        long_name_lower += "a."s;
+    }
+    long_name += "COM"s;
+    long_name_lower += "com"s;
+    assert(converter.ToAscii(long_name) == long_name_lower);
+    assert(converter.ToAscii("ü."s + long_name) == "ü."s + long_name_lower);
+
+    // один домен в двух записях даёт один ответ на всех путях ввода
+    const std::string input = "1\nпример.рф\n3\nwww.xn--e1afmkfd.xn--p1ai\nWWW.Пример.РФ\nxn--e1afmkfd.ru\n"s;
+    const std::string expected = "Bad\nBad\nGood\n"s;
+    {
+        std::istringstream in(input);
+        const std::vector<Domain> forbidden = ReadDomains(in, ReadNumberOnLine<size_t>(in));
+        const DomainChecker checker(forbidden.begin(), forbidden.end());
+        std::ostringstream out;
+        WriteVerdicts(checker, ReadDomains(in, ReadNumberOnLine<size_t>(in)), VerdictEncoder::Format::kText, out);
+        assert(out.str() == expected);
+
+        std::istringstream queries(input.substr(input.find("www")));
+        std::ostringstream pipelined;
+        CheckDomainsPipelined(checker, queries, 3, pipelined);
+        assert(pipelined.str() == expected);
+    }
+    {
+        WorkStealingPool pool(2);
+        std::istringstream in(input);
+        std::ostringstream out;
+        CheckDomainsParallel(in, out, VerdictEncoder::Format::kText, pool);
+        assert(out.str() == expected);
+    }
+}
+
+void TestCheckDistinctQueries() {
+    // считает, сколько имён ушло на проверку
+    struct CountingChecker {
+        const DomainChecker& checker;
+        size_t& checked;
+
+        void IsForbiddenBatch(std::span<const Domain> queries, std::span<bool> verdicts) const {
+            checked += queries.size();
+            checker.IsForbiddenBatch(queries, verdicts);
+        }
+    };
+
+    const std::vector<Domain> forbidden = {"gdz.ru"sv, "maps.me"sv};
+    const DomainChecker checker(forbidden.begin(), forbidden.end());
+    std::vector<Domain> queries;
+    for (size_t i = 0; i < 10'000; ++i) {
+        // серии одинаковых строк и повторы вразброс
+        queries.emplace_back(i % 7 < 4 ? "m.gdz.ru"s : "d"s + std::to_string(i / 100 % 20) + (i % 2 ? ".maps.me"s : ".com"s));
+    }
+    assert(HasManyDuplicates(queries));
+
+    size_t checked = 0;
+    std::unique_ptr<bool[]> verdicts(new bool[queries.size()]);
+    CheckDistinctQueries(CountingChecker{checker, checked}, queries, std::span(verdicts.get(), queries.size()));
+    assert(checked == 41);
+    for (size_t i = 0; i < queries.size(); ++i) {
+        assert(verdicts[i] == checker.IsForbidden(queries[i]));
+    }
+
+    // ответ в исходном порядке не зависит от того, включилась ли дедупликация
+    std::ostringstream deduplicated;
+    WriteVerdicts(checker, queries, VerdictEncoder::Format::kText, deduplicated);
+    std::ostringstream expected;
+    for (const Domain& query : queries) {
+        expected << (checker.IsForbidden(query) ? "Bad\n"sv : "Good\n"sv);
+    }
+    assert(deduplicated.str() == expected.str());
+
+    std::vector<Domain> unique_queries;
+    for (size_t i = 0; i < 10'000; ++i) {
+        unique_queries.emplace_back("d"s + std::to_string(i) + ".com"s);
+    }
+    assert(!HasManyDuplicates(unique_queries));
+    assert(!HasManyDuplicates(std::span(queries).first(100)));
+}
+
+void TestCompressedList() {
+    for (uint64_t value : {uint64_t{0}, uint64_t{1}, uint64_t{127}, uint64_t{128}, uint64_t{300}, UINT64_MAX}) {
+        std::string encoded;
+        AppendVarint(encoded, value);
+        std::string_view data = encoded;
+        assert(ReadVarint(data) == value && data.empty());
+    }
+    std::string_view truncated = "\x80"sv;
+    assert(!ReadVarint(truncated));
+
+    DomainGenerator generator(3);
+    std::vector<std::string> names;
+    for (size_t i = 0; i < 5000; ++i) {
+        names.push_back(generator.Next());
+    }
+    names.push_back(std::string(300, 'x') + ".com"s);
+    names.push_back(""s);
+    const DomainChecker checker(names.begin(), names.end());
+
+    std::ostringstream out;
+    CompressedListWriter writer(out);
+    std::string text;
+    for (size_t i = 0; i < checker.RuleCount(); ++i) {
+        writer.Add(checker.Rule(i));
+        text += std::string(checker.Rule(i).Name()) + '\n';
+    }
+    assert(writer.Finish() == checker.RuleCount());
+    const std::string data = out.str();
+    assert(IsCompressedList(data) && !IsCompressedList(text));
+    // общие концы соседних имён хранятся один раз
+    assert(data.size() < text.size());
+
+    const std::vector<Domain> rules = ReadCompressedList(data);
+    assert(rules.size() == checker.RuleCount());
+    for (size_t i = 0; i < rules.size(); ++i) {
+        assert(rules[i] == checker.Rule(i));
+    }
+    const DomainChecker loaded(DomainChecker::SortedRules{}, rules.begin(), rules.end());
+    for (size_t i = 0; i < 1000; ++i) {
+        const Domain query(generator.NextQuery(names));
+        assert(loaded.IsForbidden(query) == checker.IsForbidden(query));
+    }
+
+    // пустой список
+    std::ostringstream empty_out;
+    CompressedListWriter(empty_out).Finish();
+    assert(ReadCompressedList(empty_out.str()).empty());
+
+    // порча данных и неупорядоченные правила обнаруживаются
+    for (size_t cut : {size_t{3}, data.size() / 2, data.size() - 1}) {
+        bool thrown = false;
+        try {
+            ReadCompressedList(std::string_view(data).substr(0, cut));
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+    const std::vector<Domain> unsorted = {"b.com"sv, "a.com"sv};
+    const std::vector<Domain> covered = {"com"sv, "a.com"sv};
+    for (const std::vector<Domain>* domains : {&unsorted, &covered}) {
+        bool thrown = false;
+        try {
+            DomainChecker(DomainChecker::SortedRules{}, domains->begin(), domains->end());
+        } catch (const std::invalid_argument&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+}
+
+void TestExternalIndexBuilder() {
+    const std::filesystem::path directory = std::filesystem::temp_directory_path() /
+                                            ("domain_filter_test_"s + std::to_string(std::random_device{}()));
+    std::filesystem::create_directories(directory);
+    const std::filesystem::path index_path = directory / "index"s;
+
+    DomainGenerator generator(5);
+    std::vector<std::string> names;
+    for (size_t i = 0; i < 20'000; ++i) {
+        names.push_back(generator.Next());
+        // поддомены и повторы попадают в разные прогоны
+        if (i % 10 == 0) {
+            names.push_back("sub."s + names[i / 2]);
+            names.push_back(names[i / 3]);
+        }
+    }
+    names.push_back("com"s);
+    const DomainChecker checker(names.begin(), names.end());
+
+    for (size_t memory_limit : {size_t{0}, size_t{1} << 20, size_t{64} << 20}) {
+        ExternalIndexBuilder builder(index_path, memory_limit);
+        for (const std::string& name : names) {
+            builder.Add(name);
+        }
+        assert(builder.Finish() == checker.RuleCount());
+        // маленький предел памяти даёт много прогонов и слияние в несколько проходов
+        assert((builder.SpilledRuns() > 1) == (memory_limit < (size_t{64} << 20)));
+
+        std::ifstream index(index_path, std::ios::binary);
+        const std::string data{std::istreambuf_iterator<char>(index), std::istreambuf_iterator<char>()};
+        const std::vector<Domain> rules = ReadCompressedList(data);
+        assert(rules.size() == checker.RuleCount());
+        for (size_t i = 0; i < rules.size(); ++i) {
+            assert(rules[i] == checker.Rule(i));
+        }
+    }
+    {
+        ExternalIndexBuilder builder(index_path, 0);
+        assert(builder.Finish() == 0);
+    }
+    // слияние, прерванное посреди прохода, не оставляет уже записанных прогонов этого прохода
+    {
+        ExternalIndexBuilder builder(index_path, 0);
+        for (const std::string& name : names) {
+            builder.Add(name);
+        }
+        assert(builder.SpilledRuns() > 5);
+        std::filesystem::remove(index_path.string() + ".run4"s);
+        bool thrown = false;
+        try {
+            builder.Finish();
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+    // временные прогоны удалены
+    assert(std::distance(std::filesystem::directory_iterator(directory), std::filesystem::directory_iterator{}) == 1);
+    std::filesystem::remove_all(directory);
+}
+
+void TestCheckDomainsPipelined() {
+    const std::vector<Domain> forbidden_domains = {"gdz.ru"sv,
+                                                   "maps.me"sv,
+                                                   "m.gdz.ru"sv,
+                                                   "com"sv
+    };
+    DomainChecker checker(forbidden_domains.begin(), forbidden_domains.end());
+    // лишние строки после number доменов не проверяются
+    {
+        std::istringstream input("gdz.ru\ngdz.com\nm.maps.me\nmaps.ru\ngdz.ua\nextra.com\n"s);
+        std::ostringstream output;
+        CheckDomainsPipelined(checker, input, 5, output);
+        assert(output.str() == "Bad\nBad\nBad\nGood\nGood\n"sv);
+    }
+    // последняя строка без перевода строки и недостающие строки
+    {
+        std::istringstream input("maps.ru\nalg.m.gdz.ru"s);
+        std::ostringstream output;
+        CheckDomainsPipelined(checker, input, 3, output);
+        assert(output.str() == "Good\nBad\nGood\n"sv);
+    }
+}
+
+void TestVerdictEncoder() {
+    const std::vector<bool> verdicts = {true, false, false, true, false, false, false, false,
+                                        false, true, true};
+    auto encode = [&verdicts](VerdictEncoder::Format format) {
+        VerdictEncoder encoder(format);
+        std::string out;
+        for (bool verdict : verdicts) {
+            encoder.Add(verdict, out);
+        }
+        encoder.Finish(out);
+        return out;
+    };
+    assert(encode(VerdictEncoder::Format::kText) ==
+           "Bad\nGood\nGood\nBad\nGood\nGood\nGood\nGood\nGood\nBad\nBad\n"sv);
+    assert(encode(VerdictEncoder::Format::kBitmap) == "\x09\x06"s);
+    assert(encode(VerdictEncoder::Format::kIndices) == "\x00\x02\x05\x00"s);
+    // большие разности номеров занимают несколько байт
+    {
+        VerdictEncoder encoder(VerdictEncoder::Format::kIndices);
+        std::string out;
+        for (size_t i = 0; i < 300; ++i) {
+            encoder.Add(i == 299, out);
+        }
+        assert(out == "\xAB\x02"s);
+    }
+}
+
+void TestIsForbiddenBatch() {
+    DomainGenerator generator(7);
+    std::vector<std::string> forbidden_names(1000);
+    for (std::string& name : forbidden_names) {
+        name = generator.Next();
+    }
+    forbidden_names.push_back("com"s);
+    std::vector<Domain> queries;
+    for (size_t i = 0; i < 1000; ++i) {
+        queries.emplace_back(generator.NextQuery(forbidden_names));
+    }
+
+    for (size_t size : {size_t{0}, size_t{1}, size_t{2}, size_t{17}, forbidden_names.size()}) {
+        DomainChecker checker(forbidden_names.begin(), forbidden_names.begin() + size);
+        std::unique_ptr<bool[]> verdicts(new bool[queries.size()]);
+        checker.IsForbiddenBatch(queries, std::span(verdicts.get(), queries.size()));
+        for (size_t i = 0; i < queries.size(); ++i) {
+            assert(verdicts[i] == checker.IsForbidden(queries[i]));
+        }
+    }
+}
+
+void TestIsForbiddenJoin() {
+    DomainGenerator generator(11);
+    std::vector<std::string> forbidden_names(1000);
+    for (std::string& name : forbidden_names) {
+        name = generator.Next();
+    }
+    forbidden_names.push_back("com"s);
+    std::vector<Domain> queries;
+    for (size_t i = 0; i < 5000; ++i) {
+        queries.emplace_back(generator.NextQuery(forbidden_names));
+    }
+    // повторы и имена с одинаковыми ключами сортировки
+    queries.insert(queries.end(), queries.begin(), queries.begin() + 100);
+    queries.emplace_back("a.example.org"sv);
+    queries.emplace_back("b.example.org"sv);
+
+    for (size_t size : {size_t{0}, size_t{1}, size_t{17}, forbidden_names.size()}) {
+        const DomainChecker checker(forbidden_names.begin(), forbidden_names.begin() + size);
+        for (size_t count : {size_t{0}, size_t{1}, size_t{10}, queries.size()}) {
+            const std::span<const Domain> part = std::span(queries).first(count);
+            std::unique_ptr<bool[]> verdicts(new bool[count]);
+            checker.IsForbiddenJoin(part, std::span(verdicts.get(), count));
+            for (size_t i = 0; i < count; ++i) {
+                assert(verdicts[i] == checker.IsForbidden(part[i]));
+            }
+        }
+
+        // выбор соединения в WriteVerdicts не меняет ответ
+        std::ostringstream joined;
+        std::ostringstream searched;
+        WriteVerdicts(checker, queries, VerdictEncoder::Format::kText, joined, JoinPolicy::kAlways);
+        WriteVerdicts(checker, queries, VerdictEncoder::Format::kText, searched, JoinPolicy::kNever);
+        assert(joined.str() == searched.str());
+    }
+
+    const DomainChecker checker(forbidden_names.begin(), forbidden_names.end());
+    assert(UseJoin(checker, 5000, JoinPolicy::kAuto));
+    assert(!UseJoin(checker, 5000, JoinPolicy::kNever));
+    assert(!UseJoin(checker, 10, JoinPolicy::kAuto));
+    assert(UseJoin(checker, 10, JoinPolicy::kAlways));
+    assert(!UseJoin(ExtendedDomainChecker(forbidden_names.begin(), forbidden_names.end()), 5000, JoinPolicy::kAlways));
+}
+
+// ********************************** Дифференциальная проверка ***********************************
+// Заведомо правильная, но медленная проверка: перебор всех правил с исходным определением поддомена.
+// Правила с exact_rules[i] == true запрещают только сами себя
+bool IsForbiddenReference(const std::vector<std::string>& forbidden_names, std::string_view name,
+                          const std::vector<bool>& exact_rules = {}) {
+    const std::string dotted_name = "."s + std::string(name);
+    for (size_t i = 0; i < forbidden_names.size(); ++i) {
+        const bool exact = i < exact_rules.size() && exact_rules[i];
+        if (exact ? name == forbidden_names[i] : std::string_view(dotted_name).ends_with("."s + forbidden_names[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Генерирует небольшие списки доменов, богатые неудобными случаями: пустые имена и метки, одинаковые имена,
+// длинные цепочки поддоменов, совпадения окончаний без границы метки (ru и cru), точки и байты за пределами ASCII
+class FuzzCaseGenerator {
+public:
+    explicit FuzzCaseGenerator(uint32_t seed) : random_(seed) {
+    }
+
+    std::string NextName() {
+        static constexpr std::string_view kLabels[] = {""sv, "a"sv, "b"sv, "ru"sv, "cru"sv, "u"sv, "a-b"sv,
+                                                       "\x80"sv, "\x01"sv, "aaaaaaaa"sv, "long-label-name"sv};
+        std::string name;
+        const size_t labels_count = random_() % 6;
+        for (size_t i = 0; i < labels_count; ++i) {
+            if (i != 0) {
+                name += '.';
+            }
+            name += kLabels[random_() % std::size(kLabels)];
+        }
+        return name;
+    }
+
+    // запрос, часто связанный с одним из правил: копия, поддомен, предок или окончание без границы метки
+    std::string NextQuery(const std::vector<std::string>& forbidden_names) {
+        if (forbidden_names.empty() || random_() % 4 == 0) {
+            return NextName();
+        }
+        std::string rule = forbidden_names[random_() % forbidden_names.size()];
+        switch (random_() % 5) {
+        case 0:
+            return rule;
+        case 1:
+            return NextName() + "." + rule;
+        case 2:
+            return rule.substr(std::min(rule.size(), rule.find('.') + 1));
+        case 3:
+            return "c"s + rule;
+        default:
+            return rule.substr(random_() % (rule.size() + 1));
+        }
+    }
+
+    size_t NextSize(size_t max_size) {
+        return random_() % (max_size + 1);
+    }
+private:
+    std::mt19937 random_;
+};
+
+// Сравнивает все движки проверки с IsForbiddenReference на cases_count случайных наборах и печатает расхождения.
+// Возвращает число расхождений
+size_t RunDifferentialFuzz(uint32_t seed, size_t cases_count, std::ostream& out) {
+    FuzzCaseGenerator generator(seed);
+    size_t mismatches = 0;
+    for (size_t case_index = 0; case_index < cases_count; ++case_index) {
+        std::vector<std::string> forbidden_names(generator.NextSize(12));
+        for (std::string& name : forbidden_names) {
+            name = generator.NextName();
+        }
+        std::vector<Domain> queries;
+        for (size_t i = generator.NextSize(32); i > 0; --i) {
+            queries.emplace_back(generator.NextQuery(forbidden_names));
+        }
+
+        const DomainChecker checker(forbidden_names.begin(), forbidden_names.end());
+        const ShardedDomainChecker sharded_checker(forbidden_names.begin(), forbidden_names.end());
+        // правила раскладываются по двум спискам, и у каждого запроса должен совпасть хотя бы один
+        std::vector<DomainList> lists = {{"even"s, {}}, {"odd"s, {}}};
+        for (size_t i = 0; i < forbidden_names.size(); ++i) {
+            lists[i % 2].domains.emplace_back(forbidden_names[i]);
+        }
+        const MultiListDomainChecker multi_list_checker(lists);
+        const ExtendedDomainChecker extended_checker(forbidden_names.begin(), forbidden_names.end());
+        ShardedHitCounter hit_counter(checker.RuleCount(), 1);
+        std::unique_ptr<bool[]> batch_verdicts(new bool[queries.size()]);
+        checker.IsForbiddenBatch(queries, std::span(batch_verdicts.get(), queries.size()));
+
+        // те же имена, примерно треть из которых - правила kExact
+        std::vector<bool> exact_rules(forbidden_names.size());
+        std::vector<ForbiddenRule> rules;
+        std::vector<std::string> extended_rules;
+        for (size_t i = 0; i < forbidden_names.size(); ++i) {
+            exact_rules[i] = generator.NextSize(2) == 0;
+            rules.push_back({Domain(forbidden_names[i]), exact_rules[i] ? MatchMode::kExact : MatchMode::kSubtree});
+            extended_rules.push_back((exact_rules[i] ? "="s : ""s) + forbidden_names[i]);
+        }
+        const DomainChecker mixed_checker(rules.begin(), rules.end());
+        const ExtendedDomainChecker mixed_extended_checker(extended_rules.begin(), extended_rules.end());
+        std::unique_ptr<bool[]> mixed_batch_verdicts(new bool[queries.size()]);
+        mixed_checker.IsForbiddenBatch(queries, std::span(mixed_batch_verdicts.get(), queries.size()));
+        const FrontCodedDomainChecker front_coded_checker(checker);
+        const FrontCodedDomainChecker mixed_front_coded_checker(rules.begin(), rules.end());
+        std::unique_ptr<bool[]> join_verdicts(new bool[queries.size()]);
+        checker.IsForbiddenJoin(queries, std::span(join_verdicts.get(), queries.size()));
+        std::unique_ptr<bool[]> mixed_join_verdicts(new bool[queries.size()]);
+        mixed_checker.IsForbiddenJoin(queries, std::span(mixed_join_verdicts.get(), queries.size()));
+
+        for (size_t i = 0; i < queries.size(); ++i) {
+            std::ostringstream name;
+            name << queries[i];
+            const bool expected = IsForbiddenReference(forbidden_names, name.str());
+            const bool mixed_expected = IsForbiddenReference(forbidden_names, name.str(), exact_rules);
+            const std::tuple<std::string_view, bool, bool> verdicts[] = {
+                {"IsForbidden"sv, checker.IsForbidden(queries[i]), expected},
+                {"IsForbiddenBatch"sv, batch_verdicts[i], expected},
+                {"IsForbiddenJoin"sv, join_verdicts[i], expected},
+                {"FrontCodedDomainChecker"sv, front_coded_checker.IsForbidden(queries[i]), expected},
+                {"IsForbidden with hit counter"sv, checker.IsForbidden(queries[i], hit_counter), expected},
+                {"ShardedDomainChecker"sv, sharded_checker.IsForbidden(queries[i]), expected},
+                {"MultiListDomainChecker"sv, multi_list_checker.Lookup(queries[i]) != 0, expected},
+                {"ExtendedDomainChecker"sv, extended_checker.IsForbidden(queries[i]), expected},
+                {"IsForbidden with exact rules"sv, mixed_checker.IsForbidden(queries[i]), mixed_expected},
+                {"IsForbiddenBatch with exact rules"sv, mixed_batch_verdicts[i], mixed_expected},
+                {"IsForbiddenJoin with exact rules"sv, mixed_join_verdicts[i], mixed_expected},
+                {"FrontCodedDomainChecker with exact rules"sv, mixed_front_coded_checker.IsForbidden(queries[i]),
+                 mixed_expected},
+                {"ExtendedDomainChecker with exact rules"sv, mixed_extended_checker.IsForbidden(queries[i]), mixed_expected},
+            };
+            for (const auto& [engine, verdict, engine_expected] : verdicts) {
+                if (verdict != engine_expected) {
+                    ++mismatches;
+                    out << "seed "sv << seed << ", case "sv << case_index << ": "sv << engine << " says "sv
+                        << (verdict ? "Bad"sv : "Good"sv) << " for \""sv << name.str() << "\", forbidden:"sv;
+                    for (const std::string& rule : extended_rules) {
+                        out << " \""sv << rule << '"';
+                    }
+                    out << std::endl;
+                }
+            }
+        }
+    }
+    return mismatches;
+}
+
+void TestEnginesAgainstReference() {
+    std::ostringstream report;
+    const size_t mismatches = RunDifferentialFuzz(2024, 2000, report);
+    if (mismatches != 0) {
+        std::cerr << report.str();
+    }
+    assert(mismatches == 0);
+}
+
+void Tests() {
+    TestDomainName();
+    TestDomain();
+    TestSortKey();
+    TestReadDomains();
+    TestDomainChecker();
+    TestIsForbidden();
+    TestMatchModes();
+    TestFrontCodedDomainChecker();
+    TestShardedDomainChecker();
+    TestMultiListDomainChecker();
+    TestShardedHitCounter();
+    TestQueryCache();
+    TestLatencyHistogram();
+    TestHugePageAllocator();
+    TestReplicatedDomainChecker();
+    TestPatternAutomaton();
+    TestExtendedDomainChecker();
+    TestPublicSuffixList();
+    TestIdnaConverter();
+    TestCompressedList();
+    TestExternalIndexBuilder();
+    TestCheckDomainsPipelined();
+    TestVerdictEncoder();
+    TestCheckDistinctQueries();
+    TestIsForbiddenBatch();
+    TestIsForbiddenJoin();
+    TestEnginesAgainstReference();
+    TestWorkStealingPool();
+    TestCheckDomainsParallel();
+}
+
+// Параметры командной строки
+struct Options {
+    enum class Mode {
+        kBatch,
+        kTest,
+        kServe,
+        kClient,
+        kPipeline,
+        kBenchmark,
+        kFuzz,
+        kParallel,
+        kBuildIndex,
+    };
+
+    Mode mode = Mode::kBatch;
+    std::string socket_path;
+    size_t workers = std::max(1u, std::thread::hardware_concurrency());
+    // держать копию индекса на каждом узле NUMA
+    bool numa = false;
+    // разбирать запрещённые домены как расширенные правила (см. ExtendedDomainChecker)
+    bool extended_rules = false;
+    // хранить правила в сжатых корзинах (см. FrontCodedDomainChecker)
+    bool front_coded = false;
+    size_t batch_size = 64;
+    size_t benchmark_size = 1'000'000;
+    size_t fuzz_cases = 0;
+    uint32_t fuzz_seed = std::random_device{}();
+    VerdictEncoder::Format output_format = VerdictEncoder::Format::kText;
+    // период печати самых частых правил сервером, 0 - срабатывания не считаются
+    size_t hit_report_seconds = 0;
+    size_t hit_report_top = 20;
+    // куда записать статистику замеров ("-" - stderr), пусто - не записывать
+    std::string stats_path;
+    JoinPolicy join = JoinPolicy::kAuto;
+    // куда записать индекс в режиме kBuildIndex
+    std::string index_path;
+    // память под сборку индекса
+    size_t memory_limit = size_t{1} << 30;
+    // файл со списком запрещённых доменов или индексом; пусто - список идёт первым в stdin
+    std::string forbidden_path;
+    // размер кэша ответов сервера в записях, 0 - без кэша
+    size_t cache_size = 0;
+    // период печати доли попаданий в кэш, 0 - не печатать
+    size_t cache_report_seconds = 0;
+    // файл Public Suffix List; если задан, к ответам добавляются регистрируемые домены
+    std::string public_suffix_path;
+};
+
+Options ParseOptions(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        const std::string_view arg = argv[i];
+        auto value = [&]() -> std::string_view {
+            if (i + 1 >= argc) {
+                throw std::invalid_argument("missing value for "s + std::string(arg));
+            }
+            return argv[++i];
+        };
+        auto number = [&] {
+            const std::string_view text = value();
+            size_t result = 0;
+            const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), result);
+            if (error != std::errc{} || end != text.data() + text.size()) {
+                throw std::invalid_argument("invalid number for "s + std::string(arg));
+            }
+            return result;
+        };
+
+        if (arg == "--test"sv) {
+            options.mode = Options::Mode::kTest;
+        } else if (arg == "--serve"sv) {
+            options.mode = Options::Mode::kServe;
+            options.socket_path = value();
+        } else if (arg == "--client"sv) {
+            options.mode = Options::Mode::kClient;
+            options.socket_path = value();
+        } else if (arg == "--parallel"sv) {
+            options.mode = Options::Mode::kParallel;
+        } else if (arg == "--pipeline"sv) {
+            options.mode = Options::Mode::kPipeline;
+        } else if (arg == "--output"sv) {
+            const std::string_view format = value();
+            if (format == "text"sv) {
+                options.output_format = VerdictEncoder::Format::kText;
+            } else if (format == "bitmap"sv) {
+                options.output_format = VerdictEncoder::Format::kBitmap;
+            } else if (format == "indices"sv) {
+                options.output_format = VerdictEncoder::Format::kIndices;
+            } else {
+                throw std::invalid_argument("unknown output format: "s + std::string(format));
+            }
+        } else if (arg == "--bench"sv) {
+            options.mode = Options::Mode::kBenchmark;
+            options.benchmark_size = number();
+        } else if (arg == "--hit-report"sv) {
+            options.hit_report_seconds = number();
+        } else if (arg == "--top"sv) {
+            options.hit_report_top = number();
+        } else if (arg == "--stats"sv) {
+#ifdef DOMAIN_FILTER_STATS
+            options.stats_path = value();
+#else
+            throw std::invalid_argument("--stats requires a build with DOMAIN_FILTER_STATS defined");
+#endif
+        } else if (arg == "--fuzz"sv) {
+            options.mode = Options::Mode::kFuzz;
+            options.fuzz_cases = number();
+        } else if (arg == "--seed"sv) {
+            options.fuzz_seed = static_cast<uint32_t>(number());
+        } else if (arg == "--huge-pages"sv) {
+            HugePages::SetEnabled(true);
+        } else if (arg == "--build-index"sv) {
+            options.mode = Options::Mode::kBuildIndex;
+            options.index_path = value();
+        } else if (arg == "--memory-limit"sv) {
+            // в мегабайтах
+            options.memory_limit = number() << 20;
+        } else if (arg == "--forbidden"sv) {
+            options.forbidden_path = value();
+        } else if (arg == "--join"sv) {
+            const std::string_view policy = value();
+            if (policy == "auto"sv) {
+                options.join = JoinPolicy::kAuto;
+            } else if (policy == "on"sv) {
+                options.join = JoinPolicy::kAlways;
+            } else if (policy == "off"sv) {
+                options.join = JoinPolicy::kNever;
+            } else {
+                throw std::invalid_argument("unknown join policy: "s + std::string(policy));
+            }
+        } else if (arg == "--cache"sv) {
+            options.cache_size = number();
+        } else if (arg == "--cache-report"sv) {
+            options.cache_report_seconds = number();
+        } else if (arg == "--psl"sv) {
+            options.public_suffix_path = value();
+        } else if (arg == "--front-coded"sv) {
+            options.front_coded = true;
+        } else if (arg == "--extended"sv) {
+            options.extended_rules = true;
+        } else if (arg == "--numa"sv) {
+            options.numa = true;
+        } else if (arg == "--workers"sv) {
+            options.workers = std::max<size_t>(1, number());
+        } else if (arg == "--batch"sv) {
+            options.batch_size = std::max<size_t>(1, number());
+        } else {
+            throw std::invalid_argument("unknown option: "s + std::string(arg));
+        }
+    }
+
+    // варианты индекса и вывода есть только у пакетного режима, остальные режимы молча их бы пропустили
+    const bool batch_only = options.extended_rules || options.front_coded || options.join != JoinPolicy::kAuto ||
+                            !options.public_suffix_path.empty();
+    if (batch_only && options.mode != Options::Mode::kBatch) {
+        throw std::invalid_argument("--extended, --front-coded, --join and --psl are supported only in batch mode");
+    }
+    // срабатывания ответов из кэша не учитывались бы
+    if (options.cache_size != 0 && options.hit_report_seconds != 0) {
+        throw std::invalid_argument("--cache cannot be combined with --hit-report");
+    }
+    if (options.cache_report_seconds != 0 && options.cache_size == 0) {
+        throw std::invalid_argument("--cache-report requires --cache");
+    }
+    // пакетный режим выбирает ровно один из них, соединение умеет только обычный DomainChecker
+    const size_t variants = static_cast<size_t>(options.extended_rules) + static_cast<size_t>(options.front_coded) +
+                            static_cast<size_t>(!options.public_suffix_path.empty()) +
+                            static_cast<size_t>(options.join != JoinPolicy::kAuto);
+    if (variants > 1) {
+        throw std::invalid_argument("--extended, --front-coded, --join and --psl cannot be combined");
+    }
+    return options;
+}
+
+struct ForbiddenList {
+    std::vector<Domain> domains;
+    // список из сжатого файла: уже упорядочен и без покрытых доменов
+    bool sorted = false;
+};
+
+// Список запрещённых доменов из --forbidden или, если файл не задан, из начала stdin.
+// Файл может быть текстовым или сжатым списком, формат узнаётся по заголовку
+ForbiddenList ReadForbiddenList(const Options& options) {
+    if (options.forbidden_path.empty()) {
+        return {ReadDomains(std::cin, ReadNumberOnLine<size_t>(std::cin))};
+    }
+    std::ifstream file(options.forbidden_path, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error("cannot open "s + options.forbidden_path);
+    }
+    std::string magic(CompressedListWriter::kMagic.size(), '\0');
+    file.read(magic.data(), static_cast<std::streamsize>(magic.size()));
+    if (!IsCompressedList(magic)) {
+        file.clear();
+        file.seekg(0);
+        return {ReadDomains(file, ReadNumberOnLine<size_t>(file))};
+    }
+    std::string data(std::filesystem::file_size(options.forbidden_path), '\0');
+    file.seekg(0);
+    file.read(data.data(), static_cast<std::streamsize>(data.size()));
+    data.resize(static_cast<size_t>(file.gcount()));
+    return {ReadCompressedList(data), true};
+}
+
+std::vector<Domain> ReadForbiddenDomains(const Options& options) {
+    return ReadForbiddenList(options).domains;
+}
+
+DomainChecker MakeDomainChecker(const ForbiddenList& list) {
+    if (list.sorted) {
+        return DomainChecker(DomainChecker::SortedRules{}, list.domains.begin(), list.domains.end());
+    }
+    return DomainChecker(list.domains.begin(), list.domains.end());
+}
+
+void RunMode(const Options& options) {
+    switch (options.mode) {
+    case Options::Mode::kTest:
+        Tests();
+        return;
+#ifdef __linux__
+    case Options::Mode::kServe: {
+        const std::vector<Domain> forbidden_domains = ReadForbiddenDomains(options);
+        const ReplicatedDomainChecker checker(options.numa ? NumaTopology::Detect() : NumaTopology::SingleNode(),
+                                              forbidden_domains.begin(), forbidden_domains.end());
+        if (options.cache_size != 0) {
+            QueryCache cache(options.cache_size, options.workers);
+            std::optional<PeriodicHitReport> cache_report;
+            if (options.cache_report_seconds != 0) {
+                cache_report.emplace(cache, std::chrono::seconds(options.cache_report_seconds), std::cerr);
+            }
+            RunServer(options.socket_path, checker, options.workers, NoHitCounter{}, &cache);
+            return;
+        }
+        if (options.hit_report_seconds == 0) {
+            RunServer(options.socket_path, checker, options.workers);
+            return;
+        }
+        // номера правил одинаковы во всех копиях, имена берутся из первой
+        const auto replicas = checker.Snapshot();
+        ShardedHitCounter hit_counter(replicas->front().RuleCount());
+        const PeriodicHitReport hit_report(replicas->front(), hit_counter, std::chrono::seconds(options.hit_report_seconds),
+                                           options.hit_report_top, std::cerr);
+        RunServer(options.socket_path, checker, options.workers, hit_counter);
+        return;
+    }
+    case Options::Mode::kClient: {
+        const std::vector<Domain> test_domains = ReadDomains(std::cin, ReadNumberOnLine<size_t>(std::cin));
+        RunLoadClient(options.socket_path, test_domains, options.batch_size, std::cout);
+        return;
+    }
+#else
+    case Options::Mode::kServe:
+    case Options::Mode::kClient:
+        throw std::invalid_argument("server mode is only supported on Linux");
+#endif
+    case Options::Mode::kPipeline: {
+        // синхронизированный с stdio std::cin не сообщает, сколько байт уже пришло, и readsome
+        // в CheckDomainsPipelined ничего бы не возвращал. Ввода-вывода до этого места ещё не было
+        std::ios::sync_with_stdio(false);
+        const DomainChecker checker = MakeDomainChecker(ReadForbiddenList(options));
+        CheckDomainsPipelined(checker, std::cin, ReadNumberOnLine<size_t>(std::cin), std::cout,
+                              options.output_format);
+        return;
+    }
+    case Options::Mode::kParallel: {
+        WorkStealingPool pool(options.workers);
+        if (options.forbidden_path.empty()) {
+            CheckDomainsParallel(std::cin, std::cout, options.output_format, pool);
+            return;
+        }
+        const DomainChecker checker = MakeDomainChecker(ReadForbiddenList(options));
+        CheckDomainsParallel(std::cin, std::cout, options.output_format, pool, &checker);
+        return;
+    }
+    case Options::Mode::kBenchmark:
+        RunBenchmarks(options.benchmark_size, std::cout);
+        return;
+    case Options::Mode::kBuildIndex: {
+        ExternalIndexBuilder builder(options.index_path, options.memory_limit);
+        const size_t number = ReadNumberOnLine<size_t>(std::cin);
+        std::string line;
+        for (size_t i = 0; i < number; ++i) {
+            getline(std::cin, line);
+            builder.Add(line);
+        }
+        const size_t rules_count = builder.Finish();
+        std::cout << "rules: "sv << rules_count << ", spilled runs: "sv << builder.SpilledRuns() << std::endl;
+        return;
+    }
+    case Options::Mode::kFuzz: {
+        const size_t mismatches = RunDifferentialFuzz(options.fuzz_seed, options.fuzz_cases, std::cout);
+        std::cout << "seed "sv << options.fuzz_seed << ": "sv << options.fuzz_cases << " cases, "sv
+                  << mismatches << " mismatches"sv << std::endl;
+        if (mismatches != 0) {
+            throw std::runtime_error("engines disagree with the reference");
+        }
+        return;
+    }
+    case Options::Mode::kBatch: {
+        const ForbiddenList forbidden = ReadForbiddenList(options);
+        if (!options.public_suffix_path.empty()) {
+            if (options.output_format != VerdictEncoder::Format::kText) {
+                throw std::invalid_argument("--psl supports only text output");
+            }
+            std::ifstream file(options.public_suffix_path);
+            if (!file) {
+                throw std::runtime_error("cannot open "s + options.public_suffix_path);
+            }
+            std::vector<std::string> lines;
+            for (std::string line; getline(file, line);) {
+                lines.push_back(std::move(line));
+            }
+            const PublicSuffixList public_suffixes(lines.begin(), lines.end());
+            const DomainChecker checker = MakeDomainChecker(forbidden);
+            const std::vector<Domain> test_domains = ReadDomains(std::cin, ReadNumberOnLine<size_t>(std::cin));
+            WriteVerdictsWithRegistrable(checker, public_suffixes, test_domains, std::cout);
+            return;
+        }
+        if (options.extended_rules) {
+            const ExtendedDomainChecker checker(forbidden.domains.begin(), forbidden.domains.end());
+            const std::vector<Domain> test_domains = ReadDomains(std::cin, ReadNumberOnLine<size_t>(std::cin));
+            WriteVerdicts(checker, test_domains, options.output_format, std::cout);
+            return;
+        }
+        if (options.front_coded) {
+            const FrontCodedDomainChecker checker(MakeDomainChecker(forbidden));
+            const std::vector<Domain> test_domains = ReadDomains(std::cin, ReadNumberOnLine<size_t>(std::cin));
+            WriteVerdicts(checker, test_domains, options.output_format, std::cout);
+            return;
+        }
+        const DomainChecker checker = MakeDomainChecker(forbidden);
+
+        const std::vector<Domain> test_domains = ReadDomains(std::cin, ReadNumberOnLine<size_t>(std::cin));
+        WriteVerdicts(checker, test_domains, options.output_format, std::cout, options.join);
+        return;
+    }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        const Options options = ParseOptions(argc, argv);
+        RunMode(options);
+#ifdef DOMAIN_FILTER_STATS
+        if (options.stats_path == "-"sv) {
+            Stats::Instance().Write(std::cerr);
+        } else if (!options.stats_path.empty()) {
+            std::ofstream stats_file(options.stats_path);
+            Stats::Instance().Write(stats_file);
+        }
+#endif
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
     }
-    //Tests();
-}
\ No newline at end of file
+}